@@ -0,0 +1,58 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+
+#include "../libelf/elf.h"
+#include "../libelf/archive.h"
+
+void showUsage(std::string name) {
+    std::cerr << "Usage: " << name << " <archive> <object> [<object> ... ]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        showUsage(argv[0]);
+        return -1;
+    }
+
+    std::string archiveName = argv[1];
+    libelf::Archive archive;
+
+    for (int i = 2; i < argc; i++) {
+        std::string objectName = argv[i];
+
+        // only globally visible definitions go in the symbol index
+        libelf::ElfFile object(objectName);
+        if (!object.readHeaders() || !object.readStrings() || !object.readSymbols()) {
+            std::cerr << objectName << ": file truncated or not a recognized object" << std::endl;
+            return -1;
+        }
+
+        std::vector<std::string> symbols;
+        for (auto symbolTable: object.findSections(SHT_SYMTAB)) {
+            for (auto& symbol: symbolTable->symbols) {
+                if (symbol.name.empty() || !symbol.isDefined()) {
+                    continue;
+                }
+                if (ELF32_ST_BIND(symbol.header.st_info) == STB_LOCAL) {
+                    continue;
+                }
+                symbols.push_back(std::string(symbol.name));
+            }
+        }
+
+        std::ifstream file(objectName, std::ios::in|std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        auto slash = objectName.find_last_of('/');
+        auto memberName = slash == std::string::npos ? objectName : objectName.substr(slash + 1);
+        archive.addMember(memberName, std::move(data), symbols);
+    }
+
+    if (!archive.write(archiveName)) {
+        std::cerr << archiveName << ": unable to write archive" << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -3,6 +3,9 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <deque>
+#include <set>
 
 #include "error.h"
 #include "arch.h"
@@ -10,9 +13,44 @@
 namespace asnp {
 namespace arch {
 
-Arch::Arch(std::string name) {
+std::vector<InstructionComponent> readComponents(ryml::NodeRef ccomponents) {
     std::string noStr = "";
     int32_t noInt = 0;
+
+    std::vector<InstructionComponent> components;
+    int componentCount = ccomponents.num_children();
+    for (int c = 0; c < componentCount; c++) {
+        auto ccomponent = ccomponents[c];
+
+        InstructionComponent component;
+        ccomponent["id"] >> component.id;
+        ccomponent.get_if("skip", &component.skip, noStr);
+
+        if (!component.skip.empty() && component.skip != "zero") {
+            throw new ConfigError("unrecognized skip condition '" + component.skip + "'");
+        }
+
+        auto creplacements = ccomponent["replacements"];
+        int replacementCount = creplacements.num_children();
+        for (int r = 0; r < replacementCount; r++) {
+            auto creplacement = creplacements[r];
+
+            FragmentReplacement replacement;
+            creplacement["source"] >> replacement.source;
+            creplacement["dest"] >> replacement.dest;
+            creplacement.get_if("relocation", &replacement.relocation, noStr);
+            creplacement.get_if("shift", &replacement.shift, noInt);
+
+            component.replacements.push_back(replacement);
+        }
+        components.push_back(component);
+    }
+
+    return components;
+}
+
+Arch::Arch(std::string name) {
+    std::string noStr = "";
     uint32_t noUint = 0;
     try {
         std::ifstream file(name + ".arch.yaml", std::ios::in|std::ios::binary|std::ios::ate);
@@ -37,11 +75,23 @@ Arch::Arch(std::string name) {
         config["addressableWidth"] >> addressableWidth;
         config.get_if("pageSize", &pageSize, 0);
 
+        auto cnop = config["nop"];
+        if (cnop.readable()) {
+            int nopCount = cnop.num_children();
+            for (int i = 0; i < nopCount; i++) {
+                uint32_t byte = 0;
+                cnop[i] >> byte;
+                nop.push_back(byte);
+            }
+        }
+
         auto csegments      = config["segments"];
         auto cfragments     = config["fragments"];
         auto cformats       = config["formats"];
         auto cinstructions  = config["instructions"];
         auto crelocations   = config["relocations"];
+        auto crelaxations   = config["relaxations"];
+        auto cpeepholes     = config["peepholes"];
 
         int segmentCount = csegments.num_children();
         for (int i = 0; i < segmentCount; i++) {
@@ -60,6 +110,8 @@ Arch::Arch(std::string name) {
             csegment.get_if("ephemeral",    &segment.ephemeral,     false);
             csegment.get_if("readOnly",     &segment.readOnly,      false);
             csegment.get_if("executable",   &segment.executable,    false);
+            csegment.get_if("strings",      &segment.strings,       false);
+            csegment.get_if("entrySize",    &segment.entrySize,     segment.strings ? 1u : noUint);
 
             segments[segment.name] = segment;
         }
@@ -71,10 +123,44 @@ Arch::Arch(std::string name) {
 
             crelocation["name"] >> relocation.name;
             crelocation["type"] >> relocation.type;
+            crelocation.get_if("shift", &relocation.shift,      0);
+            crelocation.get_if("width", &relocation.width,      addressWidth);
+            crelocation.get_if("bit",   &relocation.bit,        0);
+            crelocation.get_if("mask",  &relocation.mask,       noUint);
+            crelocation.get_if("pcrel", &relocation.pcRelative, false);
+
+            if (relocation.width <= 0 || relocation.width > 32 || relocation.bit < 0 || relocation.shift < 0 || relocation.shift > 31) {
+                throw new ConfigError("invalid field for relocation '" + relocation.name + "'");
+            }
 
             relocations[relocation.name] = relocation;
         }
 
+        if (crelaxations.readable()) {
+            int relaxationCount = crelaxations.num_children();
+            for (int i = 0; i < relaxationCount; i++) {
+                auto crelaxation = crelaxations[i];
+                Relaxation relaxation;
+
+                crelaxation["relocation"] >> relaxation.relocation;
+                crelaxation["when"] >> relaxation.when;
+                crelaxation["start"] >> relaxation.start;
+                crelaxation["size"] >> relaxation.size;
+
+                if (!relocations.contains(relaxation.relocation)) {
+                    throw new ConfigError("unrecognized relocation '" + relaxation.relocation + "' in relaxation");
+                }
+                if (relaxation.when != "zero") {
+                    throw new ConfigError("unrecognized relaxation condition '" + relaxation.when + "'");
+                }
+                if (relaxation.size <= 0 || relaxation.size > 255 || relaxation.start < -128 || relaxation.start > 127) {
+                    throw new ConfigError("invalid field for relaxation of '" + relaxation.relocation + "'");
+                }
+
+                relaxations.push_back(relaxation);
+            }
+        }
+
         int fragmentCount = cfragments.num_children();
         for (int i = 0; i < fragmentCount; i++) {
             auto cfragment = cfragments[i];
@@ -127,6 +213,7 @@ Arch::Arch(std::string name) {
             }
             cinstruction["format"] >> instruction.format;
             cinstruction.get_if("id", &instruction.id, 0);
+            cinstruction.get_if("terminal", &instruction.terminal, false);
 
             std::string fragmentName;
             auto cifragments = cinstruction["fragments"];
@@ -140,27 +227,25 @@ Arch::Arch(std::string name) {
             auto ccomponents = cinstruction["components"];
             if (ccomponents.readable()) {
                 //const libconfig::Setting& ccomponents = cinstruction["components"];
-                int componentCount = ccomponents.num_children();
-                for (int c = 0; c < componentCount; c++) {
-                    auto ccomponent = ccomponents[c];
-
-                    InstructionComponent component;
-                    ccomponent["id"] >> component.id;
+                instruction.components = readComponents(ccomponents);
+            }
 
-                    auto creplacements = ccomponent["replacements"];
-                    int replacementCount = creplacements.num_children();
-                    for (int r = 0; r < replacementCount; r++) {
-                        auto creplacement = creplacements[r];
+            auto cvariants = cinstruction["variants"];
+            if (cvariants.readable()) {
+                int variantCount = cvariants.num_children();
+                for (int v = 0; v < variantCount; v++) {
+                    auto cvariant = cvariants[v];
 
-                        FragmentReplacement replacement;
-                        creplacement["source"] >> replacement.source;
-                        creplacement["dest"] >> replacement.dest;
-                        creplacement.get_if("relocation", &replacement.relocation, noStr);
-                        creplacement.get_if("shift", &replacement.shift, noInt);
+                    InstructionVariant variant;
+                    cvariant["source"] >> variant.source;
+                    cvariant.get_if("min", &variant.min, noUint);
+                    cvariant.get_if("max", &variant.max, (uint32_t) 0xffffffff);
+                    variant.components = readComponents(cvariant["components"]);
 
-                        component.replacements.push_back(replacement);
+                    if (std::find(instruction.fragments.begin(), instruction.fragments.end(), variant.source) == instruction.fragments.end()) {
+                        throw new ConfigError("unrecognized variant source '" + variant.source + "' for '" + instruction.mnemonic + "'");
                     }
-                    instruction.components.push_back(component);
+                    instruction.variants.push_back(variant);
                 }
             }
 
@@ -187,11 +272,112 @@ Arch::Arch(std::string name) {
                 indexedInstructions[instruction.id] = instruction;
             }
         }
+
+        if (cpeepholes.readable()) {
+            int peepholeCount = cpeepholes.num_children();
+            for (int i = 0; i < peepholeCount; i++) {
+                auto cpeephole = cpeepholes[i];
+                Peephole peephole;
+
+                std::set<std::string> bound;
+                for (int side = 0; side < 2; side++) {
+                    auto clines = cpeephole[side == 0 ? "match" : "replace"];
+                    auto& lines = side == 0 ? peephole.match : peephole.replace;
+                    int lineCount = clines.num_children();
+                    for (int l = 0; l < lineCount; l++) {
+                        std::string text;
+                        clines[l] >> text;
+                        auto lineTokens = tokenizeLine(text);
+
+                        if (lineTokens.empty() || !instructions.contains(lineTokens.front().content)) {
+                            throw new ConfigError("unrecognized instruction '" + text + "' in peephole");
+                        }
+                        for (auto& token: lineTokens) {
+                            if (token.content[0] != '%') {
+                                continue;
+                            }
+                            if (side == 0) {
+                                bound.insert(token.content);
+                            }
+                            else if (!bound.contains(token.content)) {
+                                throw new ConfigError("unbound operand '" + token.content + "' in peephole");
+                            }
+                        }
+                        lines.push_back(lineTokens);
+                    }
+                }
+
+                // every rewrite must shrink the code, or rewriting might not stop
+                if (peephole.match.empty() || peephole.replace.size() >= peephole.match.size()) {
+                    throw new ConfigError("peephole must replace instructions with fewer");
+                }
+                peepholes.push_back(peephole);
+            }
+        }
+        peepholeMatcher.build(peepholes);
     }
     catch (int e) {
         //throw new ConfigError("config file '" + name + ".arch' on line " + std::to_string(e.getLine()) +  ": " + e.getError());
     }
 }
 
+void PeepholeMatcher::build(const std::vector<Peephole>& peepholes) {
+    states.clear();
+    states.push_back({{}, 0, {}});
+    longest = 0;
+
+    // a trie of mnemonic sequences
+    for (size_t r = 0; r < peepholes.size(); r++) {
+        int state = 0;
+        for (auto& line: peepholes[r].match) {
+            auto& mnemonic = line.front().content;
+            if (!states[state].next.contains(mnemonic)) {
+                states[state].next[mnemonic] = states.size();
+                states.push_back({{}, 0, {}});
+            }
+            state = states[state].next[mnemonic];
+        }
+        states[state].rules.push_back(r);
+        longest = std::max(longest, peepholes[r].match.size());
+    }
+
+    // failure links, breadth first so shorter suffixes are done first
+    std::deque<int> queue;
+    for (auto& edge: states[0].next) {
+        queue.push_back(edge.second);
+    }
+    while (!queue.empty()) {
+        int state = queue.front();
+        queue.pop_front();
+
+        for (auto& edge: states[state].next) {
+            int child = edge.second;
+            states[child].fail = next(states[state].fail, edge.first);
+            auto& inherited = states[states[child].fail].rules;
+            states[child].rules.insert(states[child].rules.end(), inherited.begin(), inherited.end());
+            queue.push_back(child);
+        }
+    }
+
+    for (auto& state: states) {
+        std::stable_sort(state.rules.begin(), state.rules.end(), [&](int a, int b) {
+            return peepholes[a].match.size() > peepholes[b].match.size();
+        });
+    }
+}
+
+int PeepholeMatcher::next(int state, const std::string& mnemonic) const {
+    while (true) {
+        auto edge = states[state].next.find(mnemonic);
+        if (edge != states[state].next.end()) {
+            return edge->second;
+        }
+        if (state == 0) {
+            return 0;
+        }
+        state = states[state].fail;
+    }
+}
+
 }; // namespace arch
 }; // namespace asnp
@@ -34,6 +34,22 @@ class Relocation {
     public:
         std::string name;
         int type;
+        // how the linker applies it; see libelf::RelocationType
+        int shift;
+        int width;
+        int bit;
+        uint32_t mask;
+        bool pcRelative;
+};
+
+// Code the linker may delete once a relocation's value is known; see
+// libelf::RelaxationRule.
+class Relaxation {
+    public:
+        std::string relocation;
+        std::string when;
+        int start;
+        int size;
 };
 
 class FragmentReplacement {
@@ -47,6 +63,16 @@ class InstructionComponent {
     public:
         int id;
         std::vector<FragmentReplacement> replacements;
+        // "zero": left out when every immediate it receives is 0
+        std::string skip;
+};
+// Components used instead when an operand's value is in [min, max].
+class InstructionVariant {
+    public:
+        std::string source;
+        uint32_t min;
+        uint32_t max;
+        std::vector<InstructionComponent> components;
 };
 
 class Instruction {
@@ -57,6 +83,41 @@ class Instruction {
         std::vector<std::string> fragments;
         std::map<std::string,std::string> defaults;
         std::vector<InstructionComponent> components;
+        std::vector<InstructionVariant> variants;
+        // control never falls through to the next instruction
+        bool terminal;
+};
+
+// A run of instructions, written as source with %name standing for any
+// one operand token, and what to put in its place.
+class Peephole {
+    public:
+        std::vector<std::list<Token>> match;
+        std::vector<std::list<Token>> replace;
+};
+
+// Finds peephole windows by mnemonic in one pass over the instructions:
+// an Aho-Corasick automaton, so each instruction costs one transition no
+// matter how many rules there are. Operands are checked only once the
+// mnemonics of a rule have matched.
+class PeepholeMatcher {
+    public:
+        PeepholeMatcher(): longest(0) {}
+
+        void build(const std::vector<Peephole>&);
+        int next(int, const std::string&) const;
+        // rules whose last instruction is at this state, longest first
+        const std::vector<int>& matches(int state) const { return states[state].rules; }
+
+        size_t longest;
+    private:
+        class State {
+            public:
+                std::map<std::string, int> next;
+                int fail;
+                std::vector<int> rules;
+        };
+        std::vector<State> states;
 };
 
 class Arch {
@@ -68,13 +129,18 @@ class Arch {
         std::map<std::string, Format> formats;
         std::map<std::string, Fragment> fragments;
         std::map<std::string, Relocation> relocations;
+        std::vector<Relaxation> relaxations;
         std::map<std::string, std::list<Instruction>> instructions;
         std::map<int32_t, Instruction> indexedInstructions;
+        std::vector<Peephole> peepholes;
+        PeepholeMatcher peepholeMatcher;
 
         int dataWidth;
         int addressWidth;
         int addressableWidth;
         int pageSize;
+        // filler for executable segments
+        std::vector<uint8_t> nop;
         uint32_t textAddress;
         uint32_t dataAddress;
 };
@@ -3,7 +3,6 @@
 #include <fstream>
 #include <algorithm>
 #include <vector>
-#include <filesystem>
 #include <ctype.h>
 
 #include "error.h"
@@ -13,12 +12,11 @@
 
 namespace asnp {
 
-Assembler::Assembler(std::string out)
-  :outFile(out) {
+Assembler::Assembler(std::string out, bool _peephole, uint32_t _alignFunctions, LabelVisibility _visibility)
+  :outFile(out), peephole(_peephole), alignFunctions(_alignFunctions), visibility(_visibility), peepholeState(0), positionDependent(false) {
 }
 Assembler::~Assembler() {}
 
-#define LENGTH_LINEBUFFER 256
 bool Assembler::assemble(std::string inDir, std::string inFile) {
     if (inFile.empty()) {
         std::cerr << "Could not open input file '" << inFile << "'. Aborting." << std::endl;
@@ -28,16 +26,10 @@ bool Assembler::assemble(std::string inDir, std::string inFile) {
         inFile = inDir + inFile;
     }
 
-    std::filesystem::path filePath(inFile);
-    std::string directory = filePath.parent_path();
+    auto source = sources.load(inFile);
+    std::string directory = source->directory;
 
-    if (!directory.empty() && directory.back() != '/') {
-        directory += '/';
-    }
-
-    std::ifstream reader(inFile);
-
-    if (!reader.is_open()) {
+    if (!source->opened) {
         std::cerr << "Could not open input file '" << inFile << "'. Aborting." << std::endl;
         return false;
     }
@@ -45,71 +37,10 @@ bool Assembler::assemble(std::string inDir, std::string inFile) {
     try {
         currentLine = 1;
 
-        char lineBuffer[LENGTH_LINEBUFFER];
-        while (!reader.eof()) {
-            line = "";
-            reader.getline(lineBuffer, LENGTH_LINEBUFFER);
-            line.append(lineBuffer);
-            while (reader.fail() && !reader.eof()) {
-                reader.getline(lineBuffer, LENGTH_LINEBUFFER);
-            }
-
-            tokenize(line);
-
-            lineState = LabelState;
+        processLines(source->lines, source->tokens, directory);
 
-            while (!tokens.empty()) {
-                Token token = tokens.front();
-                tokens.pop_front();
-
-                if (lineState == LabelState) {
-                    if (token.type == Directive) {
-                        processDirective(token, directory);
-                        lineState = DoneState;
-                    }
-                    else if (!segment.get()) {
-                        throw new SyntaxError("unexpected token '" + token.content + "'", token);
-                    }
-                    else if (token.type == Label) {
-                        processLabel(token);
-                        lineState = ActionState;
-                    }
-                    else if (token.type == Identifier) {
-                        processInstruction(token);
-                        lineState = DoneState;
-                    }
-                    else {
-                        throw new SyntaxError("unexpected token '" + token.content + "'", token);
-                    }
-                }
-                else if (lineState == ActionState) {
-                    if (token.type == Directive) {
-                        processDirective(token, directory);
-                        lineState = DoneState;
-                    }
-                    else if (!segment.get()) {
-                        throw new SyntaxError("unexpected token '" + token.content + "'", token);
-                    }
-                    else if (token.type == Identifier) {
-                        processInstruction(token);
-                        lineState = DoneState;
-                    }
-                    else {
-                        throw new SyntaxError("unexpected token '" + token.content + "'", token);
-                    }
-                }
-                else {
-                    if (token.content.length() > 0 && token.content[0] == '"') {
-                        throw new SyntaxError("unexpected string " + token.content, token);
-                    }
-                    else {
-                        throw new SyntaxError("unexpected token '" + token.content + "'", token);
-                    }
-                }
-            }
-
-            currentLine++;
-        }
+        flushInstructions();
+        unalignLocalLabels();
     }
     catch (CodeError *e) {
         std::cerr << "[" << inFile << ":" << currentLine << "] ";
@@ -131,8 +62,13 @@ bool Assembler::assemble(std::string inDir, std::string inFile) {
     return true;
 }
 
-bool Assembler::link(bool outputSymbols, bool forbidExternalSymbols) {
+bool Assembler::link(bool outputSymbols, bool forbidExternalSymbols, bool relax) {
     try {
+        if (relax) {
+            std::cout << "Relaxing references" << std::endl;
+            relaxReferences(!forbidExternalSymbols);
+        }
+
         std::cout << "Resolving references" << std::endl;
         auto references = processReferences(!forbidExternalSymbols);
 
@@ -153,192 +89,565 @@ bool Assembler::link(bool outputSymbols, bool forbidExternalSymbols) {
     return true;
 }
 
-bool Assembler::write(bool raw) {
-    std::cout << "Writing data" << std::endl;
-    if (raw) {
-        // output unadorned machine code
-        auto out = std::ofstream(outFile, std::ios::binary);
+// Index of the subsection holding a segment offset; subsections are in
+// address order and the first starts at 0.
+size_t subsectionAt(const std::vector<Subsection>& subsections, uint32_t offset) {
+    auto after = std::upper_bound(subsections.begin(), subsections.end(), offset, [](uint32_t offset, const Subsection& subsection) {
+        return offset < subsection.start;
+    });
+    return after - subsections.begin() - 1;
+}
 
-        for (auto seg: segments) {
-            if (seg.second->ephemeral) {
-                continue;
-            }
-            out.write(seg.second->getData(), seg.second->getSize());
-        }
+void Assembler::showStatistics() {
+    uint64_t lookups = encodeCache.hits + encodeCache.misses;
+    std::cout << "Encode cache: " << encodeCache.hits << " hits, " << encodeCache.misses << " misses";
+    if (lookups > 0) {
+        std::cout << " (" << std::fixed << std::setprecision(1) << 100.0 * encodeCache.hits / lookups << "% hit rate)";
     }
-    else {
-        // output elf
+    std::cout << std::endl;
+}
 
-        libelf::ElfFile file(ET_REL);
+// Labels named by .local, and numeric ones, are local to the file.
+bool Assembler::isLocalLabel(const std::string& label) {
+    return localLabels.contains(label) || label.starts_with(".L");
+}
 
-        std::shared_ptr<libelf::Section> nullSection;
-        
-        auto symbolSection = file.addSection(SHT_SYMTAB, nullSection, nullSection);
-        symbolSection->name = ".symtab";
+// Whether a label ends up a global symbol; only known once the whole
+// file has been read, as .global and .local may come after the label.
+bool Assembler::isGlobalLabel(const std::string& label) {
+    return globalLabels.contains(label) || (!isLocalLabel(label) && visibility == ExportLabels);
+}
 
-        int usedSegmentCount = 0;
-        for (auto seg: segments) {
-            auto segment = seg.second;
+LabelBinding Assembler::labelBinding(const std::string& label, const std::set<std::string>& referenced) {
+    if (isGlobalLabel(label)) {
+        return GlobalLabel;
+    }
+    // numeric labels are only there for relocations to use
+    if ((visibility == DiscardLabels || label.starts_with(".L")) && !referenced.contains(label)) {
+        return DroppedLabel;
+    }
+    return LocalLabel;
+}
 
-            if (!usedSegments.contains(segment->name)) {
-                continue;
-            }
-            usedSegmentCount++;
+// The object file for what was assembled, as it stands in memory: its
+// symbols and relocations are in place, but nothing has been laid out to
+// be written. Section contents are borrowed from the segments, so the
+// assembler has to outlive it.
+std::shared_ptr<libelf::ElfFile> Assembler::buildObject(bool labelSections) {
+    auto file = std::make_shared<libelf::ElfFile>(ET_REL);
+
+    std::shared_ptr<libelf::Section> nullSection;
+    
+    auto symbolSection = file->addSection(SHT_SYMTAB, nullSection, nullSection);
+    symbolSection->name = ".symtab";
+
+    // every label a relocation will need a symbol for
+    std::set<std::string> referenced;
+    for (auto seg: segments) {
+        if (!usedSegments.contains(seg.second->name)) {
+            continue;
+        }
+        for (auto reference: seg.second->getReferences()) {
+            referenced.insert(reference.label);
+        }
+    }
 
-            Elf32_Word sectionType;
-            if (segment->ephemeral) {
-                sectionType = SHT_NOBITS;
-            }
-            else {
-                sectionType = SHT_PROGBITS;
-            }
+    // symbols and relocations are added once every section exists,
+    // as locals have to be added first
+    class PendingSymbol {
+        public:
+            std::shared_ptr<libelf::Section> section;
+            std::string name;
+            Elf32_Word offset;
+            bool local;
+    };
+    class PendingRelocation {
+        public:
+            std::shared_ptr<libelf::Section> table;
+            std::string label;
+            Elf32_Word offset;
+            uint8_t type;
+    };
+    std::vector<PendingSymbol> symbols;
+    std::vector<PendingRelocation> relocations;
+    std::set<std::string> undefined;
+
+    int usedSegmentCount = 0;
+    for (auto seg: segments) {
+        auto segment = seg.second;
+
+        if (!usedSegments.contains(segment->name)) {
+            continue;
+        }
+        usedSegmentCount++;
 
-            Elf32_Word sectionFlags = SHF_ALLOC;
-            if (!segment->readOnly) {
-                sectionFlags |= SHF_WRITE;
-            }
-            if (segment->executable) {
-                sectionFlags |= SHF_EXECINSTR;
+        Elf32_Word sectionType;
+        if (segment->ephemeral) {
+            sectionType = SHT_NOBITS;
+        }
+        else {
+            sectionType = SHT_PROGBITS;
+        }
+
+        Elf32_Word sectionFlags = SHF_ALLOC;
+        if (!segment->readOnly) {
+            sectionFlags |= SHF_WRITE;
+        }
+        if (segment->executable) {
+            sectionFlags |= SHF_EXECINSTR;
+        }
+        if (segment->entrySize > 0) {
+            sectionFlags |= SHF_MERGE;
+            if (segment->strings) {
+                sectionFlags |= SHF_STRINGS;
             }
+        }
 
-            auto section = file.addSection(sectionType, nullSection, nullSection);
-            section->name = "." + segment->name;
+        std::vector<Subsection> subsections;
+        // mergeable contents are split into pieces by the linker anyway
+        if (labelSections && segment->relocatable && segment->entrySize == 0) {
+            subsections = splitSegment(segment);
+        }
+        else {
+            uint32_t end = segment->ephemeral ? segment->getOffset() : segment->getSize();
+            subsections.push_back({"." + segment->name, 0, end});
+        }
+
+        std::vector<std::shared_ptr<libelf::Section>> sections;
+        for (auto& subsection: subsections) {
+            auto section = file->addSection(sectionType, nullSection, nullSection);
+            section->name = subsection.name;
             section->header.sh_flags = sectionFlags;
+            for (auto& alignment: segment->getAlignments()) {
+                auto boundary = alignment.offset + alignment.size;
+                if (boundary > subsection.start && boundary < subsection.end) {
+                    section->header.sh_flags |= SHF_NP_ALIGNED;
+                    break;
+                }
+            }
+            // so are .org points, up to and including one at the very end
+            for (auto origin: segment->getOrigins()) {
+                if (origin > subsection.start && origin <= subsection.end) {
+                    section->header.sh_flags |= SHF_NP_ALIGNED;
+                    break;
+                }
+            }
             section->header.sh_addralign = segment->align;
             section->header.sh_addr = segment->start;
+            section->header.sh_entsize = segment->entrySize;
 
             if (!segment->ephemeral) {
-                section->data = segment->getData(true);
-                section->header.sh_size = segment->getSize();
+                // segments outlive the file, so it can write straight from them
+                section->borrowData(segment->getData() + subsection.start, subsection.end - subsection.start);
             }
             else {
-                section->header.sh_size = segment->getOffset();
-            }
-
-            auto labels = segment->getLabels();
-            for (auto label: labels) {
-                // all symbols are globals right now...
-                symbolSection->addSymbol(section, label.first, label.second);
+                section->header.sh_size = subsection.end - subsection.start;
             }
+            sections.push_back(section);
+        }
 
-            if (segment->getReferences().size() == 0) {
+        for (auto label: segment->getLabels()) {
+            auto binding = labelBinding(label.first, referenced);
+            if (binding == DroppedLabel) {
                 continue;
             }
+            auto index = subsectionAt(subsections, label.second);
+            symbols.push_back({sections[index], label.first, label.second - subsections[index].start, binding == LocalLabel});
+        }
 
-            auto relocSection = file.addSection(SHT_REL, symbolSection, section);
-            relocSection->header.sh_info = section->index;
+        if (segment->getReferenceCount() == 0) {
+            continue;
+        }
 
-            for (auto reference: segment->getReferences()) {
-                if (!labels.contains(reference.label)) {
-                    // create new undefined symbol
-                    symbolSection->addSymbol(nullSection, reference.label, 0);
-                }
-                auto symbol = symbolSection->symbolMap[reference.label];
-                relocSection->addRelocation(section, symbol, reference.offset, reference.type);
+        std::vector<std::shared_ptr<libelf::Section>> relocSections(sections.size());
+        for (auto reference: segment->getReferences()) {
+            auto index = subsectionAt(subsections, reference.offset);
+            if (!relocSections[index]) {
+                relocSections[index] = file->addSection(SHT_REL, symbolSection, sections[index]);
+                relocSections[index]->header.sh_info = sections[index]->index;
             }
+
+            if (!labels.contains(reference.label) && !undefined.contains(reference.label)) {
+                // create new undefined symbol
+                undefined.insert(reference.label);
+                symbols.push_back({nullSection, reference.label, 0, false});
+            }
+            relocations.push_back({relocSections[index], reference.label, reference.offset - subsections[index].start, reference.type});
         }
+    }
 
-        if (architecture->pageSize > 0) {
-            auto pageSizeSection = file.addSection(SHT_LOPROC, nullSection, nullSection);
-            pageSizeSection->name = ".pagesize";
-            pageSizeSection->header.sh_addr= architecture->pageSize;
+    // locals have to come first in the symbol table
+    for (int local = 1; local >= 0; local--) {
+        for (auto& symbol: symbols) {
+            if (symbol.local == local) {
+                symbolSection->addSymbol(symbol.section, symbol.name, symbol.offset, local ? STB_LOCAL : STB_GLOBAL);
+            }
         }
+    }
+    for (auto& relocation: relocations) {
+        relocation.table->addRelocation(symbolSection->findSymbol(relocation.label), relocation.offset, relocation.type);
+    }
+
+    if (architecture->pageSize > 0) {
+        auto pageSizeSection = file->addSection(SHT_LOPROC, nullSection, nullSection);
+        pageSizeSection->name = ".pagesize";
+        pageSizeSection->header.sh_addr= architecture->pageSize;
+    }
 
-        file.generateSymbolStrings(symbolSection);
-        file.generateSectionNameStrings();
-        file.generateSectionData();
+    if (architecture->relocations.size() > 0) {
+        // tell the linker how to apply our relocation types
+        auto typeSection = file->addSection(SHT_NP_RELTYPES, nullSection, nullSection);
+        typeSection->name = ".reltypes";
+        for (auto relocation: architecture->relocations) {
+            libelf::RelocationType type = {};
+            type.type   = relocation.second.type;
+            type.mask   = relocation.second.mask;
+            type.shift  = relocation.second.shift;
+            type.width  = relocation.second.width;
+            type.bit    = relocation.second.bit;
+            type.flags  = relocation.second.pcRelative ? RELTYPE_PCREL : 0;
+            typeSection->relocationTypes.push_back(type);
+        }
+    }
 
-        file.write(outFile);
+    if (architecture->relaxations.size() > 0) {
+        // and what it may delete once their values are known
+        auto relaxSection = file->addSection(SHT_NP_RELAX, nullSection, nullSection);
+        relaxSection->name = ".relax";
+        for (auto relaxation: architecture->relaxations) {
+            libelf::RelaxationRule rule = {};
+            rule.type       = architecture->relocations[relaxation.relocation].type;
+            rule.start      = relaxation.start;
+            rule.size       = relaxation.size;
+            rule.condition  = RELAX_IF_ZERO;
+            relaxSection->relaxationRules.push_back(rule);
+        }
     }
-    return true;
+
+    return file;
 }
 
-bool _eat_whitespace(std::string line, int &index) {
-    while (isspace(line[index])) {
-        index++;
-        if (index >= line.length()) {
-            return false;
+bool Assembler::write(bool raw, bool labelSections) {
+    std::cout << "Writing data" << std::endl;
+    if (raw) {
+        // output unadorned machine code
+        auto out = std::ofstream(outFile, std::ios::binary);
+
+        for (auto seg: segments) {
+            if (seg.second->ephemeral) {
+                continue;
+            }
+            out.write(seg.second->getData(), seg.second->getSize());
         }
     }
-    if (index >= line.length()) {
-        return false;
+    else {
+        // output elf
+        auto file = buildObject(labelSections);
+
+        file->generateSymbolStrings(file->findSection(SHT_SYMTAB));
+        file->generateSectionNameStrings();
+        file->generateSectionData();
+
+        file->write(outFile);
     }
     return true;
 }
-std::string _read_word(std::string line, int &index) {
-    int start = index;
-    while (!isspace(line[index]) &&
-            line[index] != ',' && line[index] != ';' &&
-            line[index] != '(' && line[index] != ')' &&
-            line[index] != '"') {
-        index++;
-        if (index >= line.length()) {
-            break;
+
+// Cut a segment at its labels, so each label's code or data can be kept,
+// dropped or moved by the linker on its own. A cut is only made where
+// nothing depends on the bytes either side staying adjacent: code that
+// can fall through into a label, or a pc-relative reference resolved
+// here, keeps the pieces involved together.
+std::vector<Subsection> Assembler::splitSegment(std::shared_ptr<Segment> segment) {
+    uint32_t end = segment->ephemeral ? segment->getOffset() : segment->getSize();
+    auto labels = segment->getLabels();
+
+    // candidate cuts, in address order, each named for its first label
+    std::map<uint32_t, std::string> cuts;
+    for (auto label: labels) {
+        if (label.second >= end) {
+            continue;
         }
-        if (line[index] == ':') {
-            index++;
-            break;
+        if (!cuts.contains(label.second)) {
+            cuts[label.second] = label.first;
         }
     }
-    return line.substr(start, index - start);
-}
-std::string _read_punctuator(std::string line, int &index) {
-    return line.substr(index++, 1);
+
+    std::vector<Subsection> pieces;
+    if (cuts.empty() || cuts.begin()->first > 0) {
+        pieces.push_back({"." + segment->name, 0, 0});
+    }
+    for (auto cut: cuts) {
+        pieces.push_back({"." + segment->name + "." + cut.second, cut.first, 0});
+    }
+    for (size_t i = 0; i < pieces.size(); i++) {
+        pieces[i].end = i + 1 < pieces.size() ? pieces[i + 1].start : end;
+    }
+
+    // joined[i]: piece i must stay directly after piece i - 1
+    std::vector<bool> joined(pieces.size(), false);
+    if (segment->executable) {
+        auto& flowBreaks = segment->getFlowBreaks();
+        for (size_t i = 1; i < pieces.size(); i++) {
+            joined[i] = !flowBreaks.contains(pieces[i].start);
+        }
+    }
+    for (auto reference: segment->getReferences()) {
+        if (reference.relative == 0 || !labels.contains(reference.label)) {
+            continue;
+        }
+        auto from = subsectionAt(pieces, reference.offset);
+        auto to = subsectionAt(pieces, labels[reference.label]);
+        for (size_t i = std::min(from, to) + 1; i <= std::max(from, to); i++) {
+            joined[i] = true;
+        }
+    }
+
+    std::vector<Subsection> subsections;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        if (joined[i]) {
+            subsections.back().end = pieces[i].end;
+        }
+        else {
+            subsections.push_back(pieces[i]);
+        }
+    }
+
+    return subsections;
 }
-std::string _read_string(std::string line, int &index) {
-    int start = index;
-    index++;
 
-    while (index < line.length()) {
-        if (line[index] == '\\') {
-            index++;
+void Assembler::processLines(const std::vector<std::string>& lines, const std::vector<std::list<Token>>& lineTokens, std::string directory) {
+    for (size_t i = 0; i < lines.size(); i++) {
+        line = lines[i];
+        tokens = lineTokens[i];
+
+        auto first = tokens.begin();
+        if (first != tokens.end() && first->type == Label) {
+            first++;
         }
-        else if (line[index] == '"') {
-            index++;
-            break;
+        if (first != tokens.end() && (first->content == ".rept" || first->content == ".irp")) {
+            // the block runs to the matching .endr
+            size_t end = i + 1;
+            for (int depth = 1; end < lines.size(); end++) {
+                auto token = lineTokens[end].begin();
+                if (token != lineTokens[end].end() && token->type == Label) {
+                    token++;
+                }
+                if (token == lineTokens[end].end()) {
+                    continue;
+                }
+                if (token->content == ".rept" || token->content == ".irp") {
+                    depth++;
+                }
+                else if (token->content == ".endr" && --depth == 0) {
+                    break;
+                }
+            }
+            if (end >= lines.size()) {
+                throw new SyntaxError("missing .endr", *first);
+            }
+
+            std::vector<std::string> body(lines.begin() + i + 1, lines.begin() + end);
+            processRepeat(body, directory);
+
+            currentLine += end - i + 1;
+            i = end;
+            continue;
         }
-        index++;
+
+        processLine(directory);
+        currentLine++;
     }
+}
+
+void Assembler::processLine(std::string directory) {
+    lineState = LabelState;
 
-    return line.substr(start, index - start);
+    while (!tokens.empty()) {
+        Token token = tokens.front();
+        tokens.pop_front();
+
+        if (lineState == LabelState) {
+            if (token.type == Directive) {
+                flushInstructions();
+                processDirective(token, directory);
+                lineState = DoneState;
+            }
+            else if (!segment.get()) {
+                throw new SyntaxError("unexpected token '" + token.content + "'", token);
+            }
+            else if (token.type == Label) {
+                flushInstructions();
+                processLabel(token);
+                lineState = ActionState;
+            }
+            else if (token.type == Number && token.error && token.content.back() == ':') {
+                flushInstructions();
+                processNumericLabel(token);
+                lineState = ActionState;
+            }
+            else if (token.type == Identifier) {
+                queueInstruction(token);
+                lineState = DoneState;
+            }
+            else {
+                throw new SyntaxError("unexpected token '" + token.content + "'", token);
+            }
+        }
+        else if (lineState == ActionState) {
+            if (token.type == Directive) {
+                flushInstructions();
+                processDirective(token, directory);
+                lineState = DoneState;
+            }
+            else if (!segment.get()) {
+                throw new SyntaxError("unexpected token '" + token.content + "'", token);
+            }
+            else if (token.type == Identifier) {
+                queueInstruction(token);
+                lineState = DoneState;
+            }
+            else {
+                throw new SyntaxError("unexpected token '" + token.content + "'", token);
+            }
+        }
+        else {
+            if (token.content.length() > 0 && token.content[0] == '"') {
+                throw new SyntaxError("unexpected string " + token.content, token);
+            }
+            else {
+                throw new SyntaxError("unexpected token '" + token.content + "'", token);
+            }
+        }
+    }
 }
 
-void Assembler::tokenize(std::string line) {
-    int current = 0;
-    if (!_eat_whitespace(line, current)) {
-        return;
+// A .rept or .irp block, with its opening line in tokens. A body that
+// comes out the same every time and refers to nothing is encoded once
+// and copied; anything else is assembled again for each pass.
+void Assembler::processRepeat(const std::vector<std::string>& body, std::string directory) {
+    // anything still queued belongs before the block, not in its copies
+    flushInstructions();
+    if (!tokens.empty() && tokens.front().type == Label) {
+        processLabel(tokens.front());
+        tokens.pop_front();
     }
+    Token directive = tokens.front();
+    tokens.pop_front();
 
-    tokens.clear();
+    if (!architecture) {
+        throw new SyntaxError("architecture not defined", directive);
+    }
+    if (!segment) {
+        throw new SyntaxError("unexpected directive '" + directive.content + "'", directive);
+    }
 
-    while (current < line.length()) {
-        int tokenStart = current;
-        if (line[current] == ';') {
-            // Rest of the line is a comment
-            break;
+    // each pass's text, and whether they all match
+    uint32_t count = 0;
+    std::string symbol;
+    std::vector<std::string> values;
+    if (directive.content == ".rept") {
+        if (tokens.empty() || tokens.front().type != TokenType::Number) {
+            throw new SyntaxError("missing count for '.rept'", directive);
         }
+        count = tokens.front().parseNumber(32, 0, NumberSign::ForceUnsigned);
+        tokens.pop_front();
+    }
+    else {
+        if (tokens.empty() || tokens.front().type != TokenType::Identifier) {
+            throw new SyntaxError("missing symbol for '.irp'", directive);
+        }
+        symbol = "\\" + tokens.front().content;
+        tokens.pop_front();
 
-        std::string tokenString;
-        if (line[current] == '"') {
-            tokenString = _read_string(line, current);
+        while (!tokens.empty()) {
+            Token comma = tokens.front();
+            tokens.pop_front();
+            if (comma.content != "," || tokens.empty()) {
+                throw new SyntaxError("unexpected token '" + comma.content + "'", comma);
+            }
+            values.push_back(tokens.front().content);
+            tokens.pop_front();
         }
-        else if (line[current] == ',' || line[current] == '(' || line[current] == ')') {
-            tokenString = _read_punctuator(line, current);
+        // no values still runs the body once, with the symbol empty
+        if (values.empty()) {
+            values.push_back("");
         }
-        else {
-            tokenString = _read_word(line, current);
+        count = values.size();
+    }
+    if (!tokens.empty()) {
+        throw new SyntaxError("unexpected token '" + tokens.front().content + "'", tokens.front());
+    }
+
+    bool identical = symbol.empty();
+    if (!identical) {
+        identical = true;
+        for (auto& text: body) {
+            if (text.find(symbol) != std::string::npos) {
+                identical = false;
+                break;
+            }
         }
+    }
 
-        if (tokenString.length() > 0) {
-            Token token(tokenString, tokenStart);
-            tokens.push_back(token);
+    int firstLine = currentLine + 1;
+    auto pass = [&](uint32_t p) {
+        std::vector<std::string> passLines;
+        std::vector<std::list<Token>> passTokens;
+        for (auto text: body) {
+            if (!identical) {
+                for (size_t at = text.find(symbol); at != std::string::npos; at = text.find(symbol, at + values[p].length())) {
+                    text.replace(at, symbol.length(), values[p]);
+                }
+            }
+            passLines.push_back(text);
+            passTokens.push_back(tokenizeLine(text));
         }
 
-        _eat_whitespace(line, current);
+        // passes are kept apart, as if by a directive
+        flushInstructions();
+        currentLine = firstLine;
+        processLines(passLines, passTokens, directory);
+        flushInstructions();
+    };
+
+    int blockLine = currentLine;
+    if (count == 0) {
+        return;
+    }
+
+    auto bodySegment = segment;
+    uint32_t start = segment->getOffset();
+    size_t referenceCount = segment->getReferenceCount();
+    size_t labelCount = segment->getLabels().size();
+    // the flag is this body's alone; an enclosing block keeps its own
+    bool wasPositionDependent = positionDependent;
+    positionDependent = false;
+
+    pass(0);
+
+    bool copyable = identical && segment == bodySegment && !segment->ephemeral && !positionDependent
+        && segment->getReferenceCount() == referenceCount && segment->getLabels().size() == labelCount
+        && segment->getOffset() >= start;
+    if (copyable) {
+        segment->replicate(start, count - 1);
+    }
+    else {
+        for (uint32_t p = 1; p < count; p++) {
+            pass(p);
+        }
     }
+    positionDependent = positionDependent || wasPositionDependent;
+
+    currentLine = blockLine;
 }
 
 void Assembler::processDirective(Token &token, std::string directory) {
+    // only data comes out the same wherever it is put
+    if (token.content != ".byte" && token.content != ".word" && token.content != ".dword" && token.content != ".string" && token.content != ".stringz") {
+        positionDependent = true;
+    }
+
     if (token.content == ".arch") {
         if (architecture) {
             throw new SyntaxError("cannot redefine architecture", token);
@@ -355,11 +664,17 @@ void Assembler::processDirective(Token &token, std::string directory) {
 
         for (auto seg: architecture->segments) {
             segments[seg.first] = std::make_shared<Segment>(seg.second);
+            if (seg.second.executable) {
+                segments[seg.first]->nop = architecture->nop;
+            }
         }
     }
     else if (!architecture) {
         throw new SyntaxError("architecture not defined", token);
     }
+    else if (token.content == ".global" || token.content == ".globl" || token.content == ".local") {
+        declareLabels(token, token.content != ".local");
+    }
     else if (token.content == ".org" || token.content == ".origin") {
         if (tokens.empty()) {
             throw new SyntaxError("missing argument for directive '" + token.content + "'", token);
@@ -372,6 +687,50 @@ void Assembler::processDirective(Token &token, std::string directory) {
             throw new SyntaxError("unexpected token '" + directiveArg.content + "'", directiveArg);
         }
         *segment = directiveArg.parseNumber(32, 0,  NumberSign::ForceUnsigned);
+        segment->fixOrigin();
+    }
+    else if (token.content == ".align" || token.content == ".p2align") {
+        if (!segment) {
+            throw new SyntaxError("unexpected directive '" + token.content + "'", token);
+        }
+        if (tokens.empty()) {
+            throw new SyntaxError("missing argument for directive '" + token.content + "'", token);
+        }
+
+        Token directiveArg = tokens.front();
+        tokens.pop_front();
+        if (directiveArg.type != TokenType::Number) {
+            throw new SyntaxError("unexpected token '" + directiveArg.content + "'", directiveArg);
+        }
+
+        // .align takes the boundary, .p2align its power of two
+        uint32_t boundary;
+        if (token.content == ".p2align") {
+            boundary = 1 << directiveArg.parseNumber(5, 0, NumberSign::ForceUnsigned);
+        }
+        else {
+            boundary = directiveArg.parseNumber(32, 0, NumberSign::ForceUnsigned);
+            if (boundary == 0 || (boundary & (boundary - 1)) != 0) {
+                throw new SyntaxError("alignment must be a power of 2", directiveArg);
+            }
+        }
+
+        uint32_t max = boundary - 1;
+        if (!tokens.empty()) {
+            Token comma = tokens.front();
+            tokens.pop_front();
+            if (comma.content != "," || tokens.empty()) {
+                throw new SyntaxError("unexpected token '" + comma.content + "'", comma);
+            }
+            Token maxArg = tokens.front();
+            tokens.pop_front();
+            if (maxArg.type != TokenType::Number) {
+                throw new SyntaxError("unexpected token '" + maxArg.content + "'", maxArg);
+            }
+            max = maxArg.parseNumber(32, 0, NumberSign::ForceUnsigned);
+        }
+
+        segment->alignTo(boundary, max);
     }
     else if (token.content == ".segment" || token.content == ".data" || token.content == ".text" || token.content == ".rodata" || token.content == ".bss") {
         std::string segmentName;
@@ -476,6 +835,9 @@ void Assembler::processDirective(Token &token, std::string directory) {
             *segment += (uint8_t) 0;
         }
     }
+    else if (token.content == ".endr") {
+        throw new SyntaxError("'.endr' without '.rept' or '.irp'", token);
+    }
     else if (token.content == ".include") {
         Token directiveArg = tokens.front();
         tokens.pop_front();
@@ -510,6 +872,34 @@ void Assembler::processInstruction(Token &token) {
         throw new SyntaxError("unexpected identifier '" + token.content + "'", token);
     }
 
+    // a line seen before is copied from its last encoding; only when
+    // appending, as packing over existing bytes merges with them
+    std::string key;
+    uint32_t start = segment->getOffset();
+    if (start == segment->getSize()) {
+        key = EncodeCache::key(token.content, tokens);
+        auto encoded = encodeCache.find(key);
+        if (encoded && segment->canPlace(encoded->bytes.size())) {
+            for (auto byte: encoded->bytes) {
+                *segment += byte;
+            }
+            for (auto& reference: encoded->references) {
+                Reference placed = reference.reference;
+                placed.offset += start;
+                placed.relative = reference.relative ? placed.relative + start : 0;
+                segment->addReference(placed);
+            }
+            if (encoded->terminal) {
+                segment->breakFlow();
+            }
+            tokens.clear();
+            return;
+        }
+    }
+    size_t referenceCount = segment->getReferenceCount();
+    bool wasPositionDependent = positionDependent;
+    positionDependent = false;
+
     auto fragments = architecture->fragments;
     auto relocations = architecture->relocations;
 
@@ -637,12 +1027,33 @@ void Assembler::processInstruction(Token &token) {
 
         std::list<InstructionCandidate> options;
         if (candidate.instruction.format == "composite") {
-            for (auto component: candidate.instruction.components) {
+            // operand values are kept under their fragment's group, if any
+            auto sourceValue = [&](std::string source) {
+                auto group = fragments[source].group;
+                return candidate.values[group.empty() ? source : group];
+            };
+
+            // a value in range of a variant picks its components instead;
+            // a label's value is the linker's business, so it never does
+            auto components = &candidate.instruction.components;
+            for (auto& variant: candidate.instruction.variants) {
+                if (candidate.pendingReferences.contains(variant.source)) {
+                    continue;
+                }
+                auto value = sourceValue(variant.source);
+                if (value >= variant.min && value <= variant.max) {
+                    components = &variant.components;
+                    break;
+                }
+            }
+
+            for (auto component: *components) {
                 InstructionCandidate componentInstruction;
                 componentInstruction.instruction        = architecture->indexedInstructions[component.id];
                 componentInstruction.values             = candidate.values;
                 componentInstruction.pendingReferences  = candidate.pendingReferences;
 
+                bool zero = true;
                 for (auto replacement: component.replacements) {
                     if (candidate.pendingReferences.contains(replacement.source)) {
                         componentInstruction.values[replacement.dest] = candidate.values[replacement.source];
@@ -652,11 +1063,22 @@ void Assembler::processInstruction(Token &token) {
                             newReference.relocation = replacement.relocation;
                         }
                         componentInstruction.pendingReferences[replacement.dest] = newReference;
+                        zero = false;
                     }
                     else {
-                        componentInstruction.values[replacement.dest] = candidate.values[replacement.source] >> replacement.shift;
+                        uint32_t value = sourceValue(replacement.source) >> replacement.shift;
+                        componentInstruction.values[replacement.dest] = value;
+
+                        auto dest = fragments[replacement.dest];
+                        if (dest.type != "reg" && (dest.width >= 32 ? value : value & ((1u << dest.width) - 1)) != 0) {
+                            zero = false;
+                        }
                     }
                 }
+
+                if (component.skip == "zero" && zero) {
+                    continue;
+                }
                 options.push_back(componentInstruction);
             }
         }
@@ -692,6 +1114,7 @@ int totalWidth = 0;
                     auto defaultValue = option.defaults[fragmentName];
                     if (defaultValue == "%next%") {
                         value = segment->getNext(instructionWidth);
+                        positionDependent = true;
                     }
                     else {
                         value = std::stoi(defaultValue);
@@ -728,11 +1151,167 @@ int totalWidth = 0;
             }
         }
 
+        if (candidate.instruction.terminal) {
+            segment->breakFlow();
+        }
+
+        if (!key.empty() && !positionDependent) {
+            EncodedInstruction encoded;
+            encoded.bytes.assign(segment->getData() + start, segment->getData() + segment->getOffset());
+            for (auto& reference: segment->getReferencesSince(referenceCount)) {
+                ReferenceTemplate placed = {reference, reference.relative != 0};
+                placed.reference.offset -= start;
+                placed.reference.relative -= placed.relative ? start : 0;
+                encoded.references.push_back(placed);
+            }
+            encoded.terminal = candidate.instruction.terminal;
+            encodeCache.insert(key, encoded);
+        }
+        positionDependent = positionDependent || wasPositionDependent;
+
         return;
     }
 
     throw error;
 }
+// With the peephole pass on, instructions wait in a short window until
+// no rule could still use them. Anything that may not be rewritten ends
+// the window: a label or directive, or an instruction that refers to a
+// label and so carries a relocation.
+void Assembler::queueInstruction(Token &token) {
+    resolveNumericLabels(tokens);
+
+    if (!peephole || architecture->peepholes.empty()) {
+        processInstruction(token);
+        return;
+    }
+
+    QueuedInstruction instruction = {token, tokens, currentLine, line};
+    tokens.clear();
+
+    for (auto& operand: instruction.operands) {
+        if (operand.type == TokenType::Identifier && operand.content[0] != '$') {
+            flushInstructions();
+            emitInstruction(instruction);
+            return;
+        }
+    }
+
+    window.push_back(instruction);
+    peepholeState = architecture->peepholeMatcher.next(peepholeState, token.content);
+    matchPeepholes();
+
+    // the oldest can no longer begin a match
+    auto& matcher = architecture->peepholeMatcher;
+    while (window.size() >= matcher.longest && !window.empty()) {
+        emitInstruction(window.front());
+        window.erase(window.begin());
+    }
+}
+
+void Assembler::flushInstructions() {
+    for (auto& instruction: window) {
+        emitInstruction(instruction);
+    }
+    window.clear();
+    peepholeState = 0;
+}
+
+void Assembler::emitInstruction(QueuedInstruction &instruction) {
+    // errors are reported against the line the instruction came from, and
+    // the rest of the line being read is left for after it
+    int lineNumber = currentLine;
+    std::string lineText = line;
+    std::list<Token> lineTokens = std::move(tokens);
+    currentLine = instruction.line;
+    line = instruction.text;
+
+    tokens = instruction.operands;
+    processInstruction(instruction.mnemonic);
+
+    currentLine = lineNumber;
+    line = lineText;
+    tokens = std::move(lineTokens);
+}
+
+// Apply a rule to the window entries ending just before end, if their
+// operands fit it.
+bool Assembler::rewriteWindow(int rule, size_t end) {
+    auto& peephole = architecture->peepholes[rule];
+    size_t length = peephole.match.size();
+    if (length > end) {
+        return false;
+    }
+
+    std::map<std::string, std::string> bindings;
+    for (size_t i = 0; i < length; i++) {
+        auto& instruction = window[end - length + i];
+        auto& pattern = peephole.match[i];
+        if (instruction.operands.size() + 1 != pattern.size()) {
+            return false;
+        }
+
+        auto expected = std::next(pattern.begin());
+        for (auto& operand: instruction.operands) {
+            auto& content = expected->content;
+            if (content[0] == '%') {
+                if (bindings.contains(content) && bindings[content] != operand.content) {
+                    return false;
+                }
+                bindings[content] = operand.content;
+            }
+            else if (content != operand.content) {
+                return false;
+            }
+            expected++;
+        }
+    }
+
+    auto& first = window[end - length];
+    std::vector<QueuedInstruction> replacement;
+    for (auto& pattern: peephole.replace) {
+        QueuedInstruction instruction = {Token(pattern.front().content, first.mnemonic.character), {}, first.line, first.text};
+        for (auto operand = std::next(pattern.begin()); operand != pattern.end(); operand++) {
+            auto content = operand->content[0] == '%' ? bindings[operand->content] : operand->content;
+            instruction.operands.push_back(Token(content, first.mnemonic.character));
+        }
+        replacement.push_back(instruction);
+    }
+
+    window.erase(window.begin() + (end - length), window.begin() + end);
+    window.insert(window.begin() + (end - length), replacement.begin(), replacement.end());
+    return true;
+}
+
+void Assembler::matchPeepholes() {
+    auto& matcher = architecture->peepholeMatcher;
+
+    bool rewritten = false;
+    for (auto rule: matcher.matches(peepholeState)) {
+        if (rewriteWindow(rule, window.size())) {
+            rewritten = true;
+            break;
+        }
+    }
+
+    // a rewrite brings new neighbours together: go over the (short)
+    // window again until it settles. Every rewrite shrinks the window,
+    // so this ends.
+    while (rewritten) {
+        rewritten = false;
+        peepholeState = 0;
+        for (size_t i = 0; i < window.size() && !rewritten; i++) {
+            peepholeState = matcher.next(peepholeState, window[i].mnemonic.content);
+            for (auto rule: matcher.matches(peepholeState)) {
+                if (rewriteWindow(rule, i + 1)) {
+                    rewritten = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
 void Assembler::processLabel(Token &token) {
     if (labels.contains(token.content)) {
         throw new SyntaxError("duplicate label '" + token.content + "'", token);
@@ -740,9 +1319,217 @@ void Assembler::processLabel(Token &token) {
 
     labels[token.content] = segment;
 
+    // global labels are taken to be function entries; whether this is one
+    // is only settled at the end, so unalignLocalLabels() takes back
+    // padding wrongly put in
+    if (alignFunctions > 0 && segment->executable && !isLocalLabel(token.content)) {
+        size_t alignment = segment->getAlignments().size();
+        segment->alignTo(alignFunctions, alignFunctions - 1);
+        if (segment->getAlignments().size() > alignment) {
+            functionAlignments.push_back({token.content, alignment});
+        }
+    }
+
     segment->addLabel(token.content);
 }
 
+// Close up the padding --align-functions put ahead of labels that did
+// not end up global, from a .local after the label or the visibility
+// options.
+void Assembler::unalignLocalLabels() {
+    std::map<std::shared_ptr<Segment>, std::set<size_t>> unaligned;
+    for (auto& alignment: functionAlignments) {
+        if (!isGlobalLabel(alignment.first)) {
+            unaligned[labels[alignment.first]].insert(alignment.second);
+        }
+    }
+    for (auto& segment: unaligned) {
+        segment.first->unalign(segment.second);
+    }
+    functionAlignments.clear();
+}
+
+// Numeric labels may be defined any number of times; each definition
+// gets a name of its own, which 1b and 1f around it then resolve to.
+void Assembler::processNumericLabel(Token &token) {
+    std::string number = token.content.substr(0, token.content.length() - 1);
+    if (number.find_first_not_of("0123456789") != std::string::npos) {
+        throw new SyntaxError("unexpected token '" + token.content + "'", token);
+    }
+
+    Token label = token;
+    label.type = Label;
+    label.content = ".L" + number + "." + std::to_string(++numericLabels[number]);
+    processLabel(label);
+}
+
+// Turn operands like 1b and 1f into the names of the nearest numeric
+// label before and after this line.
+void Assembler::resolveNumericLabels(std::list<Token> &operands) {
+    for (auto& operand: operands) {
+        if (operand.type != TokenType::Number || operand.content.length() < 2) {
+            continue;
+        }
+        char direction = operand.content.back();
+        std::string number = operand.content.substr(0, operand.content.length() - 1);
+        if ((direction != 'b' && direction != 'f') || number.find_first_not_of("0123456789") != std::string::npos) {
+            continue;
+        }
+
+        int definition = numericLabels[number];
+        if (direction == 'f') {
+            definition++;
+        }
+        else if (definition == 0) {
+            throw new SyntaxError("no previous definition of local label '" + number + "'", operand);
+        }
+
+        operand.content = ".L" + number + "." + std::to_string(definition);
+        operand.type = TokenType::Identifier;
+    }
+}
+
+// .global and .local take a list of label names.
+void Assembler::declareLabels(Token &token, bool global) {
+    if (tokens.empty()) {
+        throw new SyntaxError("missing argument for directive '" + token.content + "'", token);
+    }
+
+    auto& declared = global ? globalLabels : localLabels;
+    auto& other = global ? localLabels : globalLabels;
+    while (true) {
+        Token name = tokens.front();
+        tokens.pop_front();
+        if (name.type != TokenType::Identifier) {
+            throw new SyntaxError("unexpected token '" + name.content + "'", name);
+        }
+        if (other.contains(name.content)) {
+            throw new SyntaxError("label '" + name.content + "' declared both global and local", name);
+        }
+        declared.insert(name.content);
+
+        if (tokens.empty()) {
+            break;
+        }
+        Token comma = tokens.front();
+        tokens.pop_front();
+        if (comma.content != "," || tokens.empty()) {
+            throw new SyntaxError("unexpected token '" + comma.content + "'", comma);
+        }
+    }
+}
+
+// Drop code the architecture marks as unneeded for the value a reference
+// ends up with, for the references resolved here rather than by the
+// linker. Deleting code moves labels, which can change the values that
+// allowed it, so deletions are decided against the layout they produce
+// and redone until they agree with it.
+void Assembler::relaxReferences(bool onlyRelative) {
+    std::map<int, const arch::Relaxation *> rules;
+    for (auto& relaxation: architecture->relaxations) {
+        rules[architecture->relocations[relaxation.relocation].type] = &relaxation;
+    }
+    if (rules.empty()) {
+        return;
+    }
+
+    class Site {
+        public:
+            std::shared_ptr<Segment> segment;
+            Reference reference;
+            const arch::Relaxation *rule;
+    };
+
+    std::vector<Site> sites;
+    for (auto segment: segments) {
+        for (auto reference: segment.second->getReferences()) {
+            if (!rules.contains(reference.type) || !labels.contains(reference.label)) {
+                continue;
+            }
+            if (reference.relative == 0 && onlyRelative) {
+                // the linker places it
+                continue;
+            }
+            sites.push_back({segment.second, reference, rules[reference.type]});
+        }
+    }
+    std::stable_sort(sites.begin(), sites.end(), [](const Site& a, const Site& b) {
+        return a.segment != b.segment ? a.segment->name < b.segment->name : a.reference.offset < b.reference.offset;
+    });
+
+    const int MAX_PASSES = 16;
+    std::map<Segment *, std::vector<Deletion>> deletions;
+    // what the deletions do to each segment, padding and .org included
+    std::map<Segment *, std::vector<Deletion>> layouts;
+    auto shifted = [&](Segment *segment, uint32_t offset) {
+        auto found = layouts.find(segment);
+        return found == layouts.end() ? offset : shiftedOffset(found->second, offset);
+    };
+
+    bool converged = false;
+    for (int pass = 0; pass < MAX_PASSES && !converged; pass++) {
+        std::map<Segment *, std::vector<Deletion>> next;
+        for (auto& site: sites) {
+            auto segment = site.segment.get();
+            auto& reference = site.reference;
+            auto labelSegment = labels[reference.label].get();
+            uint32_t labelOffset = shifted(labelSegment, labelSegment->getLabelOffset(reference.label));
+
+            // as processReferences will pack it
+            uint32_t value = labelOffset + labelSegment->getStartAddress();
+            if (reference.relative != 0) {
+                value = labelOffset - shifted(segment, reference.relative);
+            }
+            if (reference.shift > 0) {
+                value >>= reference.shift;
+            }
+            uint32_t mask = reference.width >= 32 ? 0xffffffff : (1u << reference.width) - 1;
+            if ((value & mask) != 0) {
+                continue;
+            }
+
+            long start = (long) reference.offset + site.rule->start;
+            int32_t size = site.rule->size;
+            if (start < 0 || start + size > segment->getSize()) {
+                continue;
+            }
+            auto& segmentDeletions = next[segment];
+            if (!segmentDeletions.empty() && start < segmentDeletions.back().offset + segmentDeletions.back().size) {
+                continue;
+            }
+            int32_t removedBefore = segmentDeletions.empty() ? 0 : segmentDeletions.back().removedBefore + segmentDeletions.back().size;
+            segmentDeletions.push_back({(uint32_t) start, size, removedBefore});
+        }
+        layouts.clear();
+        for (auto& entry: next) {
+            // a segment whose .org points cannot be kept is left as it is
+            if (!entry.first->layout(entry.second, layouts[entry.first])) {
+                entry.second.clear();
+                layouts.erase(entry.first);
+            }
+        }
+        std::erase_if(next, [](const auto& entry) {
+            return entry.second.empty();
+        });
+
+        converged = next.size() == deletions.size() && std::equal(next.begin(), next.end(), deletions.begin(), [](const auto& a, const auto& b) {
+            return a.first == b.first && a.second.size() == b.second.size() && std::equal(a.second.begin(), a.second.end(), b.second.begin(), [](const Deletion& x, const Deletion& y) {
+                return x.offset == y.offset && x.size == y.size;
+            });
+        });
+        deletions = std::move(next);
+    }
+
+    if (!converged) {
+        std::cerr << "Warning: relaxation did not settle after " << MAX_PASSES << " passes; not relaxing" << std::endl;
+        return;
+    }
+
+    for (auto& entry: deletions) {
+        entry.first->remove(entry.second);
+    }
+}
+
 std::map<std::string, uint32_t> Assembler::processReferences(bool onlyRelative) {
     std::map<std::string, uint32_t> symbols;
     for (auto segment: segments) {
@@ -750,7 +1537,12 @@ std::map<std::string, uint32_t> Assembler::processReferences(bool onlyRelative)
             std::string label = reference.label;
 
             if (!labels.contains(label)) {
-                if (onlyRelative) {
+                // no other file can define a local label
+                if (label.starts_with(".L")) {
+                    std::string number = label.substr(2, label.rfind('.') - 2);
+                    throw new ReferenceError("undefined reference to local label '" + number + "f'");
+                }
+                if (onlyRelative && !localLabels.contains(label)) {
                     continue;
                 }
 
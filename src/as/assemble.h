@@ -5,11 +5,16 @@
 #include <list>
 #include <memory>
 #include <set>
+#include <vector>
 
 #include "arch.h"
 #include "segment.h"
 #include "token.h"
+#include "source.h"
 #include "error.h"
+#include "encodecache.h"
+
+#include "../libelf/elf.h"
 
 namespace asnp {
 
@@ -19,6 +24,19 @@ enum LineState {
     DoneState
 };
 
+// What becomes of labels not declared .global in the symbol table.
+enum LabelVisibility {
+    ExportLabels,   // global, unless declared .local
+    HideLabels,     // local
+    DiscardLabels   // left out, unless a relocation needs them
+};
+
+enum LabelBinding {
+    GlobalLabel,
+    LocalLabel,
+    DroppedLabel
+};
+
 class PendingReference {
     public:
         std::string label;
@@ -36,14 +54,33 @@ class InstructionCandidate {
         SyntaxError *error;
 };
 
+// An instruction held back for the peephole pass, with where it came from.
+class QueuedInstruction {
+    public:
+        Token mnemonic;
+        std::list<Token> operands;
+        int line;
+        std::string text;
+};
+
+// A run of a segment's bytes written out as its own ELF section.
+class Subsection {
+    public:
+        std::string name;
+        uint32_t start;
+        uint32_t end;
+};
+
 class Assembler {
     public:
-        Assembler(std::string);
+        Assembler(std::string, bool, uint32_t, LabelVisibility);
         virtual ~Assembler();
 
         bool assemble(std::string, std::string);
-        bool link(bool, bool);
-        bool write(bool);
+        bool link(bool, bool, bool);
+        bool write(bool, bool);
+        std::shared_ptr<libelf::ElfFile> buildObject(bool);
+        void showStatistics();
     private:
         std::string outFile;
 
@@ -59,13 +96,46 @@ class Assembler {
         std::shared_ptr<Segment> segment;
         std::set<std::string> usedSegments;
         std::map<std::string, std::shared_ptr<Segment>> labels;
-
-        void tokenize(std::string);
-        
+        std::set<std::string> globalLabels;
+        std::set<std::string> localLabels;
+        // definitions so far of each numeric label
+        std::map<std::string, int> numericLabels;
+
+        SourceCache sources;
+        EncodeCache encodeCache;
+
+        bool peephole;
+        uint32_t alignFunctions;
+        LabelVisibility visibility;
+        // padding put in by alignFunctions, by the label it went ahead of
+        std::vector<std::pair<std::string, size_t>> functionAlignments;
+        std::vector<QueuedInstruction> window;
+        int peepholeState;
+
+        // set by anything whose encoding depends on where it is put
+        bool positionDependent;
+
+        void processLines(const std::vector<std::string>&, const std::vector<std::list<Token>>&, std::string);
+        void processLine(std::string);
+        void processRepeat(const std::vector<std::string>&, std::string);
         void processDirective(Token &, std::string);
         void processInstruction(Token &);
+        void queueInstruction(Token &);
+        void flushInstructions();
+        void emitInstruction(QueuedInstruction &);
+        bool rewriteWindow(int, size_t);
+        void matchPeepholes();
         void processLabel(Token &);
+        void processNumericLabel(Token &);
+        void resolveNumericLabels(std::list<Token> &);
+        void declareLabels(Token &, bool);
+        bool isLocalLabel(const std::string &);
+        bool isGlobalLabel(const std::string &);
+        LabelBinding labelBinding(const std::string &, const std::set<std::string> &);
+        void unalignLocalLabels();
+        void relaxReferences(bool);
         std::map<std::string, uint32_t> processReferences(bool);
+        std::vector<Subsection> splitSegment(std::shared_ptr<Segment>);
 };
 
 }; // namespace asnp
@@ -0,0 +1,39 @@
+#include "encodecache.h"
+
+namespace asnp {
+
+std::string EncodeCache::key(const std::string& mnemonic, const std::list<Token>& operands) {
+    std::string key = mnemonic;
+    for (auto& operand: operands) {
+        key += '\x1f';
+        key += operand.content;
+    }
+    return key;
+}
+
+const EncodedInstruction *EncodeCache::find(const std::string& key) {
+    auto found = index.find(key);
+    if (found == index.end()) {
+        misses++;
+        return 0;
+    }
+
+    hits++;
+    entries.splice(entries.begin(), entries, found->second);
+    return &found->second->second;
+}
+
+void EncodeCache::insert(const std::string& key, EncodedInstruction encoded) {
+    if (index.contains(key)) {
+        return;
+    }
+
+    if (entries.size() >= CAPACITY) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+    entries.emplace_front(key, std::move(encoded));
+    index[key] = entries.begin();
+}
+
+}; // namespace asnp
@@ -0,0 +1,55 @@
+#ifndef ENCODECACHE_H
+#define ENCODECACHE_H
+
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "segment.h"
+#include "token.h"
+
+namespace asnp {
+
+// A reference made by an encoded instruction, placed relative to the
+// start of the instruction.
+class ReferenceTemplate {
+    public:
+        Reference reference;    // offset and relative are from the start
+        bool relative;
+};
+
+// What an instruction line encodes to wherever it is put.
+class EncodedInstruction {
+    public:
+        std::vector<uint8_t> bytes;
+        std::vector<ReferenceTemplate> references;
+        bool terminal;
+};
+
+// Encodings of recently seen instruction lines, keyed by mnemonic and
+// operand text, dropping the least recently used once full.
+class EncodeCache {
+    public:
+        static const size_t CAPACITY = 4096;
+
+        EncodeCache(): hits(0), misses(0) {}
+
+        static std::string key(const std::string&, const std::list<Token>&);
+
+        const EncodedInstruction *find(const std::string&);
+        void insert(const std::string&, EncodedInstruction);
+
+        uint64_t hits;
+        uint64_t misses;
+    private:
+        typedef std::pair<std::string, EncodedInstruction> Entry;
+
+        std::list<Entry> entries;   // most recently used first
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+};
+
+}; // namespace asnp
+
+#endif
@@ -1,10 +1,54 @@
 #include "assemble.h"
+#include "../ld/linker.h"
 
 #include <iostream>
 #include <string>
+#include <cstdlib>
+#include <ctype.h>
 
 void showUsage(std::string name) {
-    std::cerr << "Usage: " << name << " [-o <out-file>] [-s] [-r] <in-file>" << std::endl;
+    std::cerr << "Usage: " << name << " [-o <out-file>] [-s] [-r] [--label-sections] [--relax] [--peephole] [--align-functions=<n>] [--stats] [--hide-labels | --discard-labels] <in-file>" << std::endl;
+    std::cerr << "       " << name << " --link [-o <out-file>] [-r] [<option> ...] [<ldnp option> ...] <in-file> [<in-file> ... ]" << std::endl;
+    std::cerr << "  with --link, sources are assembled and linked in memory; objects and archives are linked as given" << std::endl;
+}
+
+// Assemble every source and hand the objects straight to the linker, so
+// that only the final image is written. The assemblers own the section
+// contents, so they are kept until the image is out.
+int assembleAndLink(std::vector<std::string> inFiles, std::string outFile, bool labelSections, bool peephole,
+        uint32_t alignFunctions, asnp::LabelVisibility visibility, bool statistics, const ldnp::LinkOptions& options) {
+    std::vector<std::unique_ptr<asnp::Assembler>> assemblers;
+    ldnp::Linker linker(outFile);
+
+    for (auto& inFile: inFiles) {
+        if (inFile.ends_with(".o") || inFile.ends_with(".a")) {
+            continue;
+        }
+
+        auto assembler = std::make_unique<asnp::Assembler>(outFile, peephole, alignFunctions, visibility);
+        if (!assembler->assemble("", inFile)) {
+            return -1;
+        }
+        if (!assembler->link(false, false, options.relax)) {
+            return -1;
+        }
+        if (statistics) {
+            std::cout << inFile << ": ";
+            assembler->showStatistics();
+        }
+
+        auto object = assembler->buildObject(labelSections);
+        object->setFileName(inFile);
+        linker.addObject(inFile, object);
+        assemblers.push_back(std::move(assembler));
+    }
+
+    if (!linker.link(inFiles, options)) {
+        return -1;
+    }
+    std::cout << "Done." << std::endl;
+
+    return 0;
 }
 
 int main(int argc, char **argv) {
@@ -13,13 +57,63 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    std::string inFile;
+    std::vector<std::string> inFiles;
     std::string outFile;
     bool outputSymbols = false;
     bool outputRaw = false;
+    bool labelSections = false;
+    bool relax = false;
+    bool peephole = false;
+    uint32_t alignFunctions = 0;
+    bool statistics = false;
+    asnp::LabelVisibility visibility = asnp::ExportLabels;
+    bool link = false;
+    ldnp::LinkOptions linkOptions;
+    // the last option only the linker takes, which needs --link
+    std::string linkerOption;
 
     for (int i = 1; i < argc; i++) {
-        if (argv[i][0] == '-') {
+        if (argv[i][0] == '-' && argv[i][1] == '-') {
+            std::string option = argv[i];
+            if (option == "--label-sections") { // a section per label, for the linker to drop or move
+                labelSections = true;
+            }
+            else if (option == "--peephole") { // rewrite instruction sequences by the arch's rules
+                peephole = true;
+            }
+            else if (option.starts_with("--align-functions=")) { // pad so each label starts on a boundary
+                std::string value = option.substr(18);
+                char *end = 0;
+                unsigned long parsed = isdigit(value[0]) ? std::strtoul(value.c_str(), &end, 0) : 0;
+                alignFunctions = parsed <= 0x80000000 && end && *end == 0 ? parsed : 0;
+                if (alignFunctions == 0 || (alignFunctions & (alignFunctions - 1)) != 0) {
+                    std::cerr << "Alignment must be a power of 2: '" << argv[i] << "'" << std::endl;
+                    return -1;
+                }
+            }
+            else if (option == "--stats") { // report how assembly went
+                statistics = true;
+            }
+            else if (option == "--hide-labels") { // labels not declared .global become local symbols
+                visibility = asnp::HideLabels;
+            }
+            else if (option == "--discard-labels") { // and are left out unless a relocation needs them
+                visibility = asnp::DiscardLabels;
+            }
+            else if (option == "--link") { // assemble and link in one go, writing only the image
+                link = true;
+            }
+            else if (option == "--relax") { // shorten code for references resolved here
+                relax = true;
+            }
+            else if (ldnp::parseLinkOption(option, linkOptions)) { // with --link, as for ldnp
+                linkerOption = option;
+            }
+            else {
+                std::cout << "Warning: Unrecognized flag: '" << argv[i] << "'. Ignoring." << std::endl;
+            }
+        }
+        else if (argv[i][0] == '-') {
             switch (argv[i][1]) {
               case 'o': // set output file
                 i++;
@@ -39,30 +133,54 @@ int main(int argc, char **argv) {
             }
         }
         else {
-            inFile = argv[i];
+            inFiles.push_back(argv[i]);
         }
     }
 
-    if (inFile.length() <= 0) {
+    if (inFiles.empty() || (!link && inFiles.size() > 1)) {
         showUsage(argv[0]);
         return -1;
     }
 
+    if (!link && !linkerOption.empty()) {
+        std::cerr << "'" << linkerOption << "' needs --link" << std::endl;
+        return -1;
+    }
+
+    if (link) {
+        // symbol locations are only known to the linker, which has no -s
+        if (outputSymbols) {
+            std::cerr << "-s cannot be used with --link" << std::endl;
+            return -1;
+        }
+        if (outFile.length() <= 0) {
+            outFile = "a.out";
+        }
+        linkOptions.outputRaw = outputRaw;
+        linkOptions.relax = relax;
+        return assembleAndLink(inFiles, outFile, labelSections, peephole, alignFunctions, visibility, statistics, linkOptions);
+    }
+
+    std::string inFile = inFiles.front();
+
     if (outFile.length() <= 0) {
         outFile = inFile;
         outFile.append(".o");
     }
 
-    asnp::Assembler assembler(outFile);
+    asnp::Assembler assembler(outFile, peephole, alignFunctions, visibility);
     if (!assembler.assemble("", inFile)) {
         return -1;
     }
-    if (!assembler.link(outputSymbols, outputRaw)) {
+    if (!assembler.link(outputSymbols, outputRaw, relax)) {
         return -1;
     }
-    if (!assembler.write(outputRaw)) {
+    if (!assembler.write(outputRaw, labelSections)) {
         return -1;
     }
+    if (statistics) {
+        assembler.showStatistics();
+    }
     std::cout << "Done." << std::endl;
 
     return 0;
@@ -1,12 +1,15 @@
-#include <cstring>
 #include "segment.h"
 
+#include <algorithm>
+#include <cstring>
+
 namespace asnp {
 
-SegmentDescription::SegmentDescription(): relocatable(true), start(0), size(0), align(0), fill(false), ephemeral(false), readOnly(false), executable(false) {}
+SegmentDescription::SegmentDescription(): relocatable(true), start(0), size(0), align(0), fill(false), ephemeral(false), readOnly(false), executable(false), strings(false), entrySize(0) {}
 
 SegmentDescription::SegmentDescription(const SegmentDescription& original) {
     name        = original.name;
+    relocatable = original.relocatable;
     start       = original.start;
     size        = original.size;
     fill        = original.fill;
@@ -14,6 +17,8 @@ SegmentDescription::SegmentDescription(const SegmentDescription& original) {
     readOnly    = original.readOnly;
     executable  = original.executable;
     align       = original.align;
+    strings     = original.strings;
+    entrySize   = original.entrySize;
 }
 
 Segment::Segment(const SegmentDescription &base):SegmentDescription(base),offset(0) {
@@ -32,18 +37,6 @@ uint8_t& Segment::operator[](uint32_t index) {
     return data[index];
 }
 
-char *Segment::getData(bool copy) {
-    char *segmentData = (char *) data.data();
-    if (!copy) {
-        return segmentData;
-    }
-
-    char *newSegmentData = new char[getSize()];
-
-    std::memcpy(newSegmentData, segmentData, getSize());
-    return newSegmentData;
-};
-
 uint32_t& Segment::getLabelOffset(std::string index) {
     if (!labels.contains(index)) {
         labels[index] = UNDEFINED_OFFSET;
@@ -101,6 +94,266 @@ void Segment::addReference(Reference newRef) {
     references.push_back(newRef);
 }
 
+// The references added after there were a given number.
+std::vector<Reference> Segment::getReferencesSince(size_t count) {
+    std::vector<Reference> added;
+    auto reference = references.end();
+    for (size_t i = count; i < references.size(); i++) {
+        reference--;
+    }
+    added.assign(reference, references.end());
+    return added;
+}
+
+void Segment::breakFlow() {
+    flowBreaks.insert(offset);
+}
+
+uint32_t shiftedOffset(const std::vector<Deletion>& deletions, uint32_t offset) {
+    auto after = std::upper_bound(deletions.begin(), deletions.end(), offset, [](uint32_t offset, const Deletion& deletion) {
+        return offset < deletion.offset;
+    });
+    if (after == deletions.begin()) {
+        return offset;
+    }
+
+    auto& deletion = *(after - 1);
+    if (deletion.size > 0 && offset < deletion.offset + deletion.size) {
+        // inside deleted bytes: whatever comes next
+        return deletion.offset - deletion.removedBefore;
+    }
+    return (int64_t) offset - deletion.removedBefore - deletion.size;
+}
+
+void Segment::alignTo(uint32_t boundary, uint32_t max) {
+    uint32_t address = start + offset;
+    uint32_t padding = (boundary - address % boundary) % boundary;
+    if (padding > max) {
+        return;
+    }
+
+    // the linker has to keep the boundary too
+    if (boundary > align) {
+        align = boundary;
+    }
+
+    alignments.push_back({offset, padding, boundary, max});
+    if (ephemeral) {
+        offset += padding;
+    }
+    else {
+        fill(offset, padding);
+    }
+}
+
+void Segment::replicate(uint32_t from, uint32_t count) {
+    uint32_t length = offset - from;
+    if (length == 0 || count == 0) {
+        return;
+    }
+
+    uint64_t end = offset + (uint64_t) length * count;
+    if (size > 0 && end > size) {
+        throw new SegmentError("segment '" + name + "' max size of '" + std::to_string(size) + "' exceeded");
+    }
+    if (data.size() < end) {
+        data.resize(end);
+    }
+
+    for (uint32_t c = 1; c <= count; c++) {
+        std::memcpy(data.data() + from + c * length, data.data() + from, length);
+    }
+
+    // a copied jump ends fall-through just as the original does
+    std::vector<uint32_t> breaks(flowBreaks.upper_bound(from), flowBreaks.upper_bound(offset));
+    for (uint32_t c = 1; c <= count; c++) {
+        for (auto flowBreak: breaks) {
+            flowBreaks.insert(flowBreak + c * length);
+        }
+    }
+
+    offset = end;
+}
+
+void Segment::fixOrigin() {
+    origins.insert(offset);
+}
+
+// Write padding at an offset: nops, after enough zeros to line them up.
+void Segment::fill(uint32_t at, uint32_t count) {
+    uint32_t saved = offset;
+    offset = at;
+
+    uint32_t zeros = nop.empty() ? count : count % nop.size();
+    for (uint32_t i = 0; i < count; i++) {
+        *this += i < zeros ? (uint8_t) 0 : nop[(i - zeros) % nop.size()];
+    }
+
+    if (saved > at) {
+        offset = saved;
+    }
+}
+
+// What a set of deletions does to the whole segment: padding grows or
+// shrinks to keep its boundary, and an .org point keeps its address by
+// padding ahead of it. Fails if bytes before an .org point would have
+// to grow.
+bool Segment::layout(const std::vector<Deletion>& deletions, std::vector<Deletion>& adjusted, std::vector<Alignment> *realigned) {
+    adjusted.clear();
+    if (realigned) {
+        *realigned = alignments;
+    }
+
+    // origins, then padding, then deletions at the same offset
+    std::vector<std::pair<std::pair<uint32_t, int>, size_t>> events;
+    for (auto origin: origins) {
+        events.push_back({{origin, 0}, 0});
+    }
+    for (size_t a = 0; a < alignments.size(); a++) {
+        events.push_back({{alignments[a].offset, 1}, a});
+    }
+    for (size_t d = 0; d < deletions.size(); d++) {
+        events.push_back({{deletions[d].offset, 2}, d});
+    }
+    std::sort(events.begin(), events.end());
+
+    int32_t removed = 0;
+    for (auto& event: events) {
+        auto at = event.first.first;
+        switch (event.first.second) {
+          case 0:
+            if (removed < 0) {
+                return false;
+            }
+            if (removed > 0) {
+                adjusted.push_back({at, -removed, 0});
+                removed = 0;
+            }
+            break;
+          case 1: {
+            auto& alignment = alignments[event.second];
+            uint32_t address = start + at - removed;
+            uint32_t padding = (alignment.boundary - address % alignment.boundary) % alignment.boundary;
+            if (padding > alignment.max) {
+                padding = 0;
+            }
+            if (padding < alignment.size) {
+                adjusted.push_back({at + padding, (int32_t) (alignment.size - padding), 0});
+            }
+            else if (padding > alignment.size) {
+                adjusted.push_back({at + alignment.size, -(int32_t) (padding - alignment.size), 0});
+            }
+            if (realigned) {
+                (*realigned)[event.second].offset = at - removed;
+                (*realigned)[event.second].size = padding;
+            }
+            removed += (int32_t) alignment.size - (int32_t) padding;
+            break;
+          }
+          case 2:
+            adjusted.push_back(deletions[event.second]);
+            removed += deletions[event.second].size;
+            break;
+        }
+    }
+
+    int32_t removedBefore = 0;
+    for (auto& adjustment: adjusted) {
+        adjustment.removedBefore = removedBefore;
+        removedBefore += adjustment.size;
+    }
+
+    return true;
+}
+
+// Drop alignments as if they had never been asked for, closing up their
+// padding. Later padding and .org points adjust as they do for remove().
+void Segment::unalign(const std::set<size_t>& which) {
+    for (auto a: which) {
+        alignments[a].max = 0;
+    }
+    remove({});
+
+    std::vector<Alignment> kept;
+    for (size_t a = 0; a < alignments.size(); a++) {
+        if (!which.contains(a)) {
+            kept.push_back(alignments[a]);
+        }
+    }
+    alignments = std::move(kept);
+}
+
+void Segment::remove(const std::vector<Deletion>& deletions) {
+    std::vector<Deletion> adjusted;
+    std::vector<Alignment> realigned;
+    if (!layout(deletions, adjusted, &realigned) || adjusted.empty()) {
+        return;
+    }
+
+    std::vector<uint8_t> kept;
+    kept.reserve(data.capacity());
+    uint32_t from = 0;
+    for (auto& adjustment: adjusted) {
+        uint32_t to = std::min((uint32_t) data.size(), adjustment.offset);
+        if (from < to) {
+            kept.insert(kept.end(), data.begin() + from, data.begin() + to);
+        }
+        if (adjustment.size > 0) {
+            from = adjustment.offset + adjustment.size;
+        }
+        else {
+            // filled in properly below
+            kept.insert(kept.end(), -adjustment.size, 0);
+            from = adjustment.offset;
+        }
+    }
+    if (from < data.size()) {
+        kept.insert(kept.end(), data.begin() + from, data.end());
+    }
+    data = std::move(kept);
+
+    for (auto& label: labels) {
+        if (label.second != UNDEFINED_OFFSET) {
+            label.second = shiftedOffset(adjusted, label.second);
+        }
+    }
+
+    // references in deleted bytes went with them
+    references.remove_if([&](const Reference& reference) {
+        auto after = std::upper_bound(deletions.begin(), deletions.end(), reference.offset, [](uint32_t offset, const Deletion& deletion) {
+            return offset < deletion.offset;
+        });
+        return after != deletions.begin() && reference.offset < (after - 1)->offset + (after - 1)->size;
+    });
+    for (auto& reference: references) {
+        reference.offset = shiftedOffset(adjusted, reference.offset);
+        if (reference.relative != 0) {
+            reference.relative = shiftedOffset(adjusted, reference.relative);
+        }
+    }
+
+    std::set<uint32_t> breaks;
+    for (auto flowBreak: flowBreaks) {
+        breaks.insert(shiftedOffset(adjusted, flowBreak));
+    }
+    flowBreaks = std::move(breaks);
+
+    // padding is redone for where it ends up
+    alignments = std::move(realigned);
+    for (auto& alignment: alignments) {
+        if (!ephemeral) {
+            fill(alignment.offset, alignment.size);
+        }
+    }
+    for (auto& adjustment: adjusted) {
+        if (adjustment.size < 0 && origins.contains(adjustment.offset)) {
+            fill(adjustment.offset - adjustment.removedBefore, -adjustment.size);
+        }
+    }
+
+    offset = shiftedOffset(adjusted, offset);
+}
+
 void Segment::pack(uint32_t value, int width, uint32_t byte, int &bit) {
     do {
         int startBit = bit;
@@ -5,6 +5,7 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <set>
 
 #include "error.h"
 
@@ -21,6 +22,28 @@ class Reference {
         uint8_t type;
 };
 
+// Bytes taken out of a segment by relaxation, with the total taken out
+// ahead of them. A negative size puts bytes back, where padding has to
+// grow to keep what follows in place.
+class Deletion {
+    public:
+        uint32_t offset;
+        int32_t size;
+        int32_t removedBefore;
+};
+
+// Padding placed to bring the bytes after it to a boundary.
+class Alignment {
+    public:
+        uint32_t offset;
+        uint32_t size;
+        uint32_t boundary;
+        uint32_t max;       // most padding allowed; past that, none
+};
+
+// Where a segment offset moves to once deletions are made.
+uint32_t shiftedOffset(const std::vector<Deletion>&, uint32_t);
+
 class SegmentDescription {
     public:
         static const uint32_t UNDEFINED_OFFSET = 0xffffffff;
@@ -36,6 +59,10 @@ class SegmentDescription {
         bool ephemeral;
         bool readOnly;
         bool executable;
+        // contents are interchangeable pieces the linker may merge:
+        // NUL-terminated strings, or constants of entrySize bytes
+        bool strings;
+        uint32_t entrySize;
 };
 
 class Segment : public SegmentDescription {
@@ -48,18 +75,33 @@ class Segment : public SegmentDescription {
 
         bool canPlace(int width) { return size == 0 || (offset + width < size); }
         const std::list<Reference> getReferences() { return references; }
+        size_t getReferenceCount() { return references.size(); }
+        std::vector<Reference> getReferencesSince(size_t);
         const std::map<std::string, uint32_t> getLabels() { return labels; }
+        const std::set<uint32_t>& getFlowBreaks() { return flowBreaks; }
+        const std::vector<Alignment>& getAlignments() { return alignments; }
+        const std::set<uint32_t>& getOrigins() { return origins; }
         const uint32_t getSize() { return data.size(); }
         uint32_t getOffset() { return offset; }
         uint32_t getNext(int width) { return start + offset + width; }
 
         uint32_t getStartAddress() { return start; }
-        char * getData(bool copy = false);
+        char * getData() { return (char *) data.data(); }
 
         Segment& operator=(uint32_t);       // set offset
         Segment& operator+=(uint8_t);       // place byte at current offset
         void addLabel(std::string);         // create a label at current offset
         void addReference(Reference);       // add a reference
+        void breakFlow();                   // nothing falls through to the current offset
+        void alignTo(uint32_t, uint32_t);   // pad up to a boundary
+        void replicate(uint32_t, uint32_t); // copy the bytes since an offset, more times
+        void fixOrigin();                   // the current offset keeps its address
+        bool layout(const std::vector<Deletion>&, std::vector<Deletion>&, std::vector<Alignment> *realigned = 0);
+        void remove(const std::vector<Deletion>&); // take out bytes, moving everything after
+        void unalign(const std::set<size_t>&);     // take out the padding of some alignments
+
+        // padding for executable segments; zeros otherwise
+        std::vector<uint8_t> nop;
 
         void pack(uint32_t, int, uint32_t, int&);
     private:
@@ -68,6 +110,11 @@ class Segment : public SegmentDescription {
         std::vector<uint8_t> data;
         std::map<std::string, uint32_t> labels;
         std::list<Reference> references;
+        std::set<uint32_t> flowBreaks;
+        std::vector<Alignment> alignments;
+        std::set<uint32_t> origins;
+
+        void fill(uint32_t, uint32_t);
 };
 
 class SegmentError : public AssemblyError {
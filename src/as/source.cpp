@@ -0,0 +1,154 @@
+#include <fstream>
+#include <filesystem>
+
+#include "source.h"
+
+namespace asnp {
+
+SourceFile::SourceFile(std::string _path): path(_path), opened(false) {
+    std::filesystem::path filePath(path);
+    directory = filePath.parent_path();
+
+    if (!directory.empty() && directory.back() != '/') {
+        directory += '/';
+    }
+}
+
+bool SourceFile::read() {
+    std::ifstream reader(path, std::ios::in|std::ios::binary|std::ios::ate);
+    if (!reader.is_open()) {
+        return false;
+    }
+
+    size_t size = reader.tellg();
+    reader.seekg(0);
+
+    std::string content(size, '\0');
+    reader.read(content.data(), size);
+    reader.close();
+    opened = true;
+
+    size_t start = 0;
+    while (true) {
+        size_t end = content.find('\n', start);
+        if (end == std::string::npos) {
+            lines.push_back(content.substr(start));
+            break;
+        }
+        lines.push_back(content.substr(start, end - start));
+        start = end + 1;
+    }
+
+    tokens.reserve(lines.size());
+    for (auto line: lines) {
+        tokens.push_back(tokenizeLine(line));
+
+        // look ahead for includes so they can be prefetched
+        auto token = tokens.back().begin();
+        auto end = tokens.back().end();
+        if (token != end && token->type == Label) {
+            token++;
+        }
+        if (token == end || token->content != ".include") {
+            continue;
+        }
+        token++;
+        if (token == end || token->type != String || token->error || token->content.length() < 3) {
+            continue;
+        }
+
+        std::string include = token->content.substr(1, token->content.length() - 2);
+        if (include.front() != '/') {
+            include = directory + include;
+        }
+        includes.push_back(include);
+    }
+
+    return true;
+}
+
+SourceCache::~SourceCache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    pending.notify_all();
+
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+std::shared_ptr<SourceFile> SourceCache::load(std::string path) {
+    std::shared_future<std::shared_ptr<SourceFile>> future;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (files.contains(path)) {
+            future = files[path];
+        }
+    }
+    if (future.valid()) {
+        return future.get();
+    }
+
+    // nobody asked for this one ahead of time; read it here
+    auto file = std::make_shared<SourceFile>(path);
+    file->read();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!files.contains(path)) {
+            PendingFile ready;
+            ready.set_value(file);
+            files[path] = ready.get_future().share();
+        }
+    }
+
+    for (auto include: file->includes) {
+        prefetch(include);
+    }
+
+    return file;
+}
+
+void SourceCache::prefetch(std::string path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping || files.contains(path)) {
+        return;
+    }
+
+    PendingFile promise;
+    files[path] = promise.get_future().share();
+    queue.emplace_back(path, std::move(promise));
+
+    if (!worker.joinable()) {
+        worker = std::thread(&SourceCache::work, this);
+    }
+    pending.notify_one();
+}
+
+void SourceCache::work() {
+    while (true) {
+        std::pair<std::string, PendingFile> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pending.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        auto file = std::make_shared<SourceFile>(job.first);
+        file->read();
+
+        for (auto include: file->includes) {
+            prefetch(include);
+        }
+
+        job.second.set_value(file);
+    }
+}
+
+}; // namespace asnp
@@ -0,0 +1,59 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "token.h"
+
+namespace asnp {
+
+class SourceFile {
+    public:
+        SourceFile(std::string);
+
+        std::string path;
+        std::string directory;
+        bool opened;
+
+        std::vector<std::string> lines;
+        std::vector<std::list<Token>> tokens;
+        std::vector<std::string> includes;  // resolved paths of .include targets
+
+        bool read();
+};
+
+// Loads and lexes source files. Files named by .include directives are
+// handed to a worker thread as soon as their includer has been lexed, so
+// they are usually ready by the time the main pass reaches them.
+class SourceCache {
+    public:
+        SourceCache(): stopping(false) {}
+        ~SourceCache();
+
+        std::shared_ptr<SourceFile> load(std::string);
+        void prefetch(std::string);
+    private:
+        typedef std::promise<std::shared_ptr<SourceFile>> PendingFile;
+
+        std::mutex mutex;
+        std::condition_variable pending;
+        std::deque<std::pair<std::string, PendingFile>> queue;
+        std::map<std::string, std::shared_future<std::shared_ptr<SourceFile>>> files;
+        bool stopping;
+        std::thread worker;
+
+        void work();
+};
+
+}; // namespace asnp
+
+#endif
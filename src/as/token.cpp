@@ -1,4 +1,5 @@
 #include <bit>
+#include <ctype.h>
 #include "token.h"
 #include "error.h"
 
@@ -178,4 +179,91 @@ uint32_t Token::parseNumber(int maxBits, int subtract, NumberSign sign, int skip
     return value;
 }
 
+bool _eat_whitespace(std::string line, int &index) {
+    while (isspace(line[index])) {
+        index++;
+        if (index >= line.length()) {
+            return false;
+        }
+    }
+    if (index >= line.length()) {
+        return false;
+    }
+    return true;
+}
+std::string _read_word(std::string line, int &index) {
+    int start = index;
+    while (!isspace(line[index]) &&
+            line[index] != ',' && line[index] != ';' &&
+            line[index] != '(' && line[index] != ')' &&
+            line[index] != '"') {
+        index++;
+        if (index >= line.length()) {
+            break;
+        }
+        if (line[index] == ':') {
+            index++;
+            break;
+        }
+    }
+    return line.substr(start, index - start);
+}
+std::string _read_punctuator(std::string line, int &index) {
+    return line.substr(index++, 1);
+}
+std::string _read_string(std::string line, int &index) {
+    int start = index;
+    index++;
+
+    while (index < line.length()) {
+        if (line[index] == '\\') {
+            index++;
+        }
+        else if (line[index] == '"') {
+            index++;
+            break;
+        }
+        index++;
+    }
+
+    return line.substr(start, index - start);
+}
+
+std::list<Token> tokenizeLine(std::string line) {
+    std::list<Token> tokens;
+
+    int current = 0;
+    if (!_eat_whitespace(line, current)) {
+        return tokens;
+    }
+
+    while (current < line.length()) {
+        int tokenStart = current;
+        if (line[current] == ';') {
+            // Rest of the line is a comment
+            break;
+        }
+
+        std::string tokenString;
+        if (line[current] == '"') {
+            tokenString = _read_string(line, current);
+        }
+        else if (line[current] == ',' || line[current] == '(' || line[current] == ')') {
+            tokenString = _read_punctuator(line, current);
+        }
+        else {
+            tokenString = _read_word(line, current);
+        }
+
+        if (tokenString.length() > 0) {
+            Token token(tokenString, tokenStart);
+            tokens.push_back(token);
+        }
+
+        _eat_whitespace(line, current);
+    }
+
+    return tokens;
+}
+
 }; // namespace asnp
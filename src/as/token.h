@@ -2,6 +2,7 @@
 #define TOKEN_H
 
 #include <string>
+#include <list>
 #include <cstdint>
 
 namespace asnp {
@@ -35,6 +36,8 @@ class Token {
     private:
 };
 
+std::list<Token> tokenizeLine(std::string);
+
 }; // namespace asnp
 
 #endif
@@ -0,0 +1,147 @@
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include "../libelf/elf.h"
+#include "../ld/linker.h"
+
+void showUsage(std::string name) {
+    std::cerr << "Usage: " << name << " [-n <fixups>] [-f <files>] [-r <runs>]" << std::endl;
+    std::cerr << "  links generated n16r objects in memory and times applying their relocations" << std::endl;
+}
+
+// One object holding its share of the fixups. Its .text is all fixup
+// sites, each patched either with a jump to the next file's function or
+// with a byte of the address of its own data, as adr does.
+std::shared_ptr<libelf::ElfFile> generateObject(size_t file, size_t files, size_t fixups) {
+    std::shared_ptr<libelf::Section> nullSection;
+    auto object = std::make_shared<libelf::ElfFile>(ET_REL);
+
+    auto symbols = object->addSection(SHT_SYMTAB, nullSection, nullSection);
+    symbols->name = ".symtab";
+
+    auto text = object->addSection(SHT_PROGBITS, nullSection, nullSection);
+    text->name = ".text";
+    text->header.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    text->header.sh_addralign = 2;
+    text->header.sh_addr = 0x1000;
+    char *code = new char[fixups * 4];
+    std::memset(code, 0, fixups * 4);
+    text->takeData(code, fixups * 4);
+
+    auto rodata = object->addSection(SHT_PROGBITS, nullSection, nullSection);
+    rodata->name = ".rodata";
+    rodata->header.sh_flags = SHF_ALLOC;
+    rodata->header.sh_addralign = 4;
+    rodata->header.sh_addr = 0x1000;
+    char *bytes = new char[4];
+    std::memset(bytes, 0, 4);
+    rodata->takeData(bytes, 4);
+
+    std::string function = file == 0 ? "__main" : "f" + std::to_string(file);
+    std::string next = (file + 1) % files == 0 ? "__main" : "f" + std::to_string((file + 1) % files);
+    std::string data = "d" + std::to_string(file);
+    symbols->addSymbol(text, function, 0);
+    symbols->addSymbol(rodata, data, 0);
+    if (next != function) {
+        symbols->addSymbol(nullSection, next, 0);
+    }
+
+    auto relocations = object->addSection(SHT_REL, symbols, text);
+    relocations->relocations.reserve(fixups);
+    Elf32_Word jump = symbols->findSymbol(next);
+    Elf32_Word address = symbols->findSymbol(data);
+    const uint8_t types[] = {N16R_REL_JMP, N16R_REL_B0, N16R_REL_B1, N16R_REL_B2, N16R_REL_B3};
+    for (size_t f = 0; f < fixups; f++) {
+        uint8_t type = types[f % 5];
+        relocations->addRelocation(type == N16R_REL_JMP ? jump : address, f * 4, type);
+    }
+
+    auto pageSize = object->addSection(SHT_LOPROC, nullSection, nullSection);
+    pageSize->name = ".pagesize";
+    pageSize->header.sh_addr = 0x1000;
+
+    // as n16r.arch.yaml describes them
+    auto typeSection = object->addSection(SHT_NP_RELTYPES, nullSection, nullSection);
+    typeSection->name = ".reltypes";
+    typeSection->relocationTypes = {
+        // type          mask shift width bit flags
+        {N16R_REL_JMP,   0,   1,    28,   4,  0},
+        {N16R_REL_B0,    0,   0,     8,   0,  0},
+        {N16R_REL_B1,    0,   8,     8,   0,  0},
+        {N16R_REL_B2,    0,  16,     8,   0,  0},
+        {N16R_REL_B3,    0,  24,     8,   0,  0},
+    };
+
+    return object;
+}
+
+int main(int argc, char **argv) {
+    size_t fixups = 1000000;
+    size_t files = 64;
+    int runs = 5;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc || (option != "-n" && option != "-f" && option != "-r")) {
+            showUsage(argv[0]);
+            return -1;
+        }
+
+        char *end = 0;
+        unsigned long value = std::strtoul(argv[++i], &end, 0);
+        if (*end != 0 || value == 0) {
+            showUsage(argv[0]);
+            return -1;
+        }
+        if (option == "-n") {
+            fixups = value;
+        }
+        else if (option == "-f") {
+            files = value;
+        }
+        else {
+            runs = value;
+        }
+    }
+    if (files > fixups) {
+        files = fixups;
+    }
+
+    // the objects are built in memory, as asnp --link does, so only the
+    // link itself is measured
+    ldnp::Linker linker("bench.out");
+    std::vector<std::string> names;
+    for (size_t f = 0; f < files; f++) {
+        size_t share = fixups / files + (f < fixups % files ? 1 : 0);
+        names.push_back("bench" + std::to_string(f) + ".o");
+        auto object = generateObject(f, files, share);
+        object->setFileName(names.back());
+        linker.addObject(names.back(), object);
+    }
+
+    if (!linker.loadFiles(names) || !linker.resolveReferences() || !linker.mergeSections() || !linker.positionSegments()) {
+        return -1;
+    }
+
+    // the first run also takes each section's private copy of its data
+    double best = 0;
+    for (int r = 0; r < runs; r++) {
+        auto start = std::chrono::steady_clock::now();
+        if (!linker.relocateSegments()) {
+            return -1;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << "run " << (r + 1) << ": " << elapsed.count() * 1000 << " ms" << std::endl;
+        if (r == 0 || elapsed.count() < best) {
+            best = elapsed.count();
+        }
+    }
+
+    std::cout << fixups << " fixups in " << files << " files: best " << best * 1000 << " ms, ";
+    std::cout << (uint64_t) (fixups / best) << " fixups/s" << std::endl;
+
+    return 0;
+}
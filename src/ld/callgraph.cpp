@@ -0,0 +1,99 @@
+#include "callgraph.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace ldnp {
+
+size_t CallGraph::addSection(uint32_t size) {
+    nodes.push_back({size, 0, -1, 0});
+    return nodes.size() - 1;
+}
+
+void CallGraph::addCall(size_t caller, size_t callee, uint64_t weight) {
+    if (caller == callee || weight == 0) {
+        return;
+    }
+    calls[{caller, callee}] += weight;
+}
+
+std::vector<size_t> CallGraph::order(uint32_t clusterLimit) {
+    for (auto& call: calls) {
+        auto [caller, callee] = call.first;
+        auto& node = nodes[callee];
+
+        node.weight += call.second;
+        nodes[caller].weight += call.second;
+        if (call.second > node.bestWeight) {
+            node.bestWeight = call.second;
+            node.bestCaller = caller;
+        }
+    }
+
+    struct Cluster {
+        std::vector<size_t> members;
+        uint64_t size;
+        uint64_t weight;
+
+        double density() const { return size == 0 ? weight : (double) weight / size; }
+    };
+
+    std::vector<Cluster> clusters(nodes.size());
+    std::vector<size_t> clusterOf(nodes.size());
+    for (size_t n = 0; n < nodes.size(); n++) {
+        clusters[n] = {{n}, nodes[n].size, nodes[n].weight};
+        clusterOf[n] = n;
+    }
+
+    // hottest first; ties keep input order
+    std::vector<size_t> byWeight(nodes.size());
+    std::iota(byWeight.begin(), byWeight.end(), 0);
+    std::stable_sort(byWeight.begin(), byWeight.end(), [&](size_t a, size_t b) {
+        return nodes[a].weight > nodes[b].weight;
+    });
+
+    for (auto n: byWeight) {
+        if (nodes[n].bestCaller < 0) {
+            continue;
+        }
+
+        auto& into = clusters[clusterOf[nodes[n].bestCaller]];
+        auto& from = clusters[clusterOf[n]];
+        if (&into == &from || into.size + from.size > clusterLimit) {
+            continue;
+        }
+
+        // don't let a hot cluster be diluted by a much colder one
+        Cluster merged = {{}, into.size + from.size, into.weight + from.weight};
+        if (merged.density() * 8 < into.density()) {
+            continue;
+        }
+
+        for (auto member: from.members) {
+            clusterOf[member] = clusterOf[nodes[n].bestCaller];
+        }
+        into.members.insert(into.members.end(), from.members.begin(), from.members.end());
+        into.size = merged.size;
+        into.weight = merged.weight;
+        from.members.clear();
+    }
+
+    std::vector<Cluster *> ordered;
+    for (auto& cluster: clusters) {
+        if (!cluster.members.empty() && cluster.weight > 0) {
+            ordered.push_back(&cluster);
+        }
+    }
+    std::stable_sort(ordered.begin(), ordered.end(), [](Cluster *a, Cluster *b) {
+        return a->density() > b->density();
+    });
+
+    std::vector<size_t> result;
+    for (auto cluster: ordered) {
+        result.insert(result.end(), cluster->members.begin(), cluster->members.end());
+    }
+
+    return result;
+}
+
+}; // namespace ldnp
@@ -0,0 +1,41 @@
+#ifndef CALLGRAPH_H
+#define CALLGRAPH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <map>
+
+namespace ldnp {
+
+// Orders sections so hot callers and their callees end up next to each
+// other, following the C3 heuristic (Ottoni and Maher, "Optimizing
+// Function Placement for Large-Scale Data-Center Applications"): each
+// section is appended to the cluster of its heaviest caller, hottest
+// first, as long as the cluster stays within a page and doesn't get much
+// colder; clusters are then laid out densest first.
+class CallGraph {
+    public:
+        // returns the section's node number
+        size_t addSection(uint32_t);
+        void addCall(size_t, size_t, uint64_t);
+
+        // node numbers of the sections that take part in any call, in
+        // their new order; the rest are left where they are
+        std::vector<size_t> order(uint32_t);
+    private:
+        struct Node {
+            uint32_t size;
+            uint64_t weight;
+            // heaviest caller so far, and the weight of its calls
+            long bestCaller;
+            uint64_t bestWeight;
+        };
+
+        std::vector<Node> nodes;
+        std::map<std::pair<size_t, size_t>, uint64_t> calls;
+};
+
+}; // namespace ldnp
+
+#endif
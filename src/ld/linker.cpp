@@ -1,90 +1,857 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <set>
+#include <map>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
 
 #include "linker.h"
+#include "parallel.h"
+#include "relocation.h"
+#include "callgraph.h"
 
 namespace ldnp {
 
+Elf32_Word shiftedOffset(const std::vector<Deletion>&, Elf32_Word);
+
+// Take one long option of ldnp's into options; false if it is not one.
+bool parseLinkOption(const std::string& option, LinkOptions& options) {
+    if (option == "--gc-sections") { // drop sections unreachable from __main
+        options.gcSections = true;
+    }
+    else if (option == "--icf") { // fold identical read-only sections
+        options.foldSections = true;
+    }
+    else if (option == "--relax") { // shorten code once addresses are known
+        options.relax = true;
+    }
+    else if (option == "--call-graph-order") { // place callers near their callees
+        options.callGraphOrder = true;
+    }
+    else if (option.starts_with("--call-graph-profile=")) { // weigh calls by measured counts
+        options.profileFile = option.substr(21);
+    }
+    else if (option.starts_with("--symbol-ordering-file=")) { // place these symbols first
+        options.orderingFile = option.substr(23);
+    }
+    else if (option.starts_with("--keep=")) { // treat a symbol as reachable
+        options.keepSymbols.push_back(option.substr(7));
+    }
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+// Every stage of a link in order, from loading the inputs to writing the
+// image.
+bool Linker::link(std::vector<std::string> inFileNames, const LinkOptions& options) {
+    if (!loadFiles(inFileNames)) {
+        return false;
+    }
+    if (!resolveReferences()) {
+        return false;
+    }
+    if (options.gcSections && !collectGarbage(options.keepSymbols)) {
+        return false;
+    }
+    if (options.foldSections && !foldIdenticalSections()) {
+        return false;
+    }
+    if (!mergeSections()) {
+        return false;
+    }
+    bool order = options.callGraphOrder || !options.profileFile.empty() || !options.orderingFile.empty();
+    if (order && !orderSections(options.callGraphOrder, options.profileFile, options.orderingFile)) {
+        return false;
+    }
+    if (!positionSegments()) {
+        return false;
+    }
+    if (options.relax && !relaxSections()) {
+        return false;
+    }
+    if (!relocateSegments()) {
+        return false;
+    }
+    if (!generateOutputFile()) {
+        return false;
+    }
+
+    return writeOutputFile(options.outputRaw);
+}
+
 bool Linker::loadFiles(std::vector<std::string> inFileNames) {
-    for (auto fileName: inFileNames) {
-        auto inFile = std::make_shared<libelf::ElfFile>(fileName);
-        if (!inFile->readHeaders()) {
+    std::vector<std::shared_ptr<libelf::ElfFile>> objects;
+
+    // archives only have their headers and symbol index read up front
+    for (auto& inFileName: inFileNames) {
+        if (builtObjects.contains(inFileName)) {
+            objects.push_back(builtObjects[inFileName]);
+            continue;
+        }
+        if (!libelf::Archive::isArchive(inFileName)) {
+            objects.push_back(std::make_shared<libelf::ElfFile>(inFileName));
+            continue;
+        }
+
+        auto archive = std::make_shared<libelf::Archive>(inFileName);
+        if (!archive->read()) {
+            std::cerr << inFileName << ": malformed archive" << std::endl;
             return false;
         }
-        if (!inFile->readStrings()) {
+        archives.push_back(archive);
+    }
+
+    if (!loadObjects(objects)) {
+        return false;
+    }
+
+    return loadArchiveMembers();
+}
+
+// An object built in memory, by an assembler linking its output directly,
+// to be used where loadFiles() is given its name.
+void Linker::addObject(std::string inFileName, std::shared_ptr<libelf::ElfFile> object) {
+    builtObjects[inFileName] = object;
+}
+
+// Everything the linker uses from an object file, once its headers are in.
+bool readObject(std::shared_ptr<libelf::ElfFile> inFile) {
+    return inFile->readStrings()
+        && inFile->readSymbols()
+        && inFile->readRelocations()
+        && inFile->readProgBits()
+        && inFile->readRelocationTypes()
+        && inFile->readRelaxationRules();
+}
+
+bool Linker::loadObjects(std::vector<std::shared_ptr<libelf::ElfFile>> objects) {
+    // slots are filled in input order, whichever thread gets there first
+    // (bytes rather than vector<bool>, so neighbours can be set concurrently)
+    size_t first = files.size();
+    files.insert(files.end(), objects.begin(), objects.end());
+    relocationTables.resize(files.size());
+    std::vector<uint8_t> loaded(objects.size(), false);
+    std::vector<uint8_t> recognized(objects.size(), false);
+
+    parallelFor(objects.size(), [&](size_t i) {
+        auto inFile = objects[i];
+
+        // objects built in memory already have their sections filled in
+        bool read = inFile->sectionCount() == 0;
+        if (read && !inFile->readHeaders()) {
+            return;
+        }
+        recognized[i] = true;
+
+        if (read && !readObject(inFile)) {
+            return;
+        }
+
+        // compile the file's relocation descriptions
+        if (inFile->findSections(SHT_NP_RELTYPES).empty()) {
+            relocationTables[first + i].loadDefaults();
+        }
+        for (auto section: inFile->findSections(SHT_NP_RELTYPES)) {
+            if (!relocationTables[first + i].load(section->relocationTypes)) {
+                std::cerr << inFile->getFileName() << ": invalid relocation type descriptions" << std::endl;
+                return;
+            }
+        }
+        for (auto section: inFile->findSections(SHT_NP_RELAX)) {
+            if (!relocationTables[first + i].loadRelaxations(section->relaxationRules)) {
+                std::cerr << inFile->getFileName() << ": invalid relaxation rules" << std::endl;
+                return;
+            }
+        }
+
+        loaded[i] = true;
+    });
+
+    // report the first failure in input order, as a serial load would
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (loaded[i]) {
+            continue;
+        }
+        if (!recognized[i]) {
+            std::cerr << objects[i]->getFileName() << ": file truncated or not a recognized object" << std::endl;
+        }
+        files.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool Linker::loadArchiveMembers() {
+    std::unordered_set<std::string_view> defined;
+    std::vector<std::string_view> undefined = {"__main"};
+    std::set<std::pair<size_t, long>> extracted;
+    size_t scanned = 0;
+
+    // Archives behave as one group searched after the objects: a member
+    // is pulled in when it defines something still undefined, and its own
+    // references may pull in more, until nothing changes.
+    while (archives.size() > 0) {
+        for (; scanned < files.size(); scanned++) {
+            for (auto symbolTable: files[scanned]->findSections(SHT_SYMTAB)) {
+                for (auto& symbol: symbolTable->symbols) {
+                    if (symbol.name.empty() || symbol.isLocal()) {
+                        continue;
+                    }
+                    if (symbol.isDefined()) {
+                        defined.insert(symbol.name);
+                    }
+                    else {
+                        undefined.push_back(symbol.name);
+                    }
+                }
+            }
+        }
+
+        std::set<std::pair<size_t, long>> wanted;
+        for (auto name: undefined) {
+            if (defined.contains(name)) {
+                continue;
+            }
+            for (size_t a = 0; a < archives.size(); a++) {
+                auto member = archives[a]->findSymbol(name);
+                if (member >= 0) {
+                    if (!extracted.contains({a, member})) {
+                        wanted.insert({a, member});
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (wanted.empty()) {
+            break;
+        }
+
+        // members load in archive order, so the output doesn't depend on
+        // the order names happened to be looked up in
+        std::vector<std::shared_ptr<libelf::ElfFile>> members;
+        for (auto& member: wanted) {
+            extracted.insert(member);
+            members.push_back(archives[member.first]->getMember(member.second));
+        }
+
+        if (!loadObjects(members)) {
             return false;
         }
-        if (!inFile->readSymbols()) {
+    }
+
+    return true;
+}
+
+libelf::Symbol& Linker::getSymbol(SymbolReference reference) {
+    return symbolTables[reference.file]->symbols[reference.symbol];
+}
+
+Elf32_Word Linker::symbolAddress(SymbolReference reference) {
+    auto file = files[reference.file];
+    auto& symbol = getSymbol(reference);
+
+    // symbols in mergeable sections follow their piece to its merged copy
+    if (!mergedInputs.empty() && symbol.isDefined() && symbol.header.st_shndx < file->sectionCount()) {
+        auto merged = mergedInputs.find(file->getSection(symbol.header.st_shndx).get());
+        if (merged != mergedInputs.end()) {
+            return merged->second.first->address(merged->second.second, symbol.header.st_value);
+        }
+    }
+
+    // and those in sections being relaxed move with the deletions
+    if (!sectionDeletions.empty() && symbol.isDefined() && symbol.header.st_shndx < file->sectionCount()) {
+        auto section = file->getSection(symbol.header.st_shndx);
+        auto deletions = sectionDeletions.find(section.get());
+        if (deletions != sectionDeletions.end()) {
+            return section->header.sh_addr + shiftedOffset(deletions->second, symbol.header.st_value);
+        }
+    }
+
+    return file->symbolAddress(symbol);
+}
+
+bool Linker::resolveReferences() {
+    SymbolTable symbols;
+
+    // every name is hashed once, here, and reused by the binding pass
+    std::vector<std::vector<size_t>> hashes(files.size());
+    symbolTables.resize(files.size());
+
+    parallelFor(files.size(), [&](size_t f) {
+        auto symbolTable = files[f]->findSection(SHT_SYMTAB);
+        symbolTables[f] = symbolTable;
+        auto& fileHashes = hashes[f];
+
+        fileHashes.resize(symbolTable->symbols.size());
+        for (Elf32_Word s = 0; s < symbolTable->symbols.size(); s++) {
+            auto& symbol = symbolTable->symbols[s];
+            fileHashes[s] = SymbolTable::hash(symbol.name);
+
+            // ignore undefined symbols at this point, and local ones
+            // altogether: they only ever mean their own definition
+            if (symbol.isDefined() && !symbol.isLocal()) {
+                symbols.insert(symbol.name, fileHashes[s], {(Elf32_Word) f, s});
+            }
+        }
+    });
+
+    // diagnostics are gathered per file and printed in input order below
+    std::vector<std::string> duplicateErrors(files.size());
+    std::vector<std::string> undefinedErrors(files.size());
+    resolvedSymbols.resize(files.size());
+
+    parallelFor(files.size(), [&](size_t f) {
+        auto file = files[f];
+        auto symbolTable = symbolTables[f];
+        auto& fileHashes = hashes[f];
+        std::ostringstream errors;
+
+        auto& resolved = resolvedSymbols[f];
+        resolved.resize(symbolTable->symbols.size());
+        std::vector<bool> undefined(resolved.size(), false);
+
+        for (Elf32_Word s = 0; s < resolved.size(); s++) {
+            auto& symbol = symbolTable->symbols[s];
+            SymbolReference self = {(Elf32_Word) f, s};
+
+            if (symbol.isLocal()) {
+                resolved[s] = self;
+                undefined[s] = !symbol.isDefined();
+            }
+            else if (!symbols.find(symbol.name, fileHashes[s], resolved[s])) {
+                // until bound, a symbol refers to itself
+                resolved[s] = self;
+                undefined[s] = true;
+            }
+            else if (symbol.isDefined() && resolved[s] != self) {
+                errors << file->getFileName() << ": multiple definition of symbol '" << symbol.name << "'" << std::endl;
+            }
+        }
+        duplicateErrors[f] = errors.str();
+        errors.str("");
+
+        std::set<std::string_view> previouslyUndefinedSymbols;
+        for (auto section: file->findSections(SHT_REL)) {
+            auto relSection = file->getSection(section->header.sh_info);
+            for (auto& relocation: section->relocations) {
+                if (!undefined[relocation.symbol]) {
+                    continue;
+                }
+
+                auto& symbol = symbolTable->symbols[relocation.symbol];
+                if (!previouslyUndefinedSymbols.contains(symbol.name)) {
+                    previouslyUndefinedSymbols.insert(symbol.name);
+                    errors << file->getFileName() << ":(" << relSection->name << "+0x" << std::hex << relocation.offset << std::dec << "): undefined symbol '" << symbol.name << "'" << std::endl;
+                }
+            }
+        }
+        undefinedErrors[f] = errors.str();
+    });
+
+    bool duplicateSymbols = false;
+    for (auto errors: duplicateErrors) {
+        if (!errors.empty()) {
+            duplicateSymbols = true;
+            std::cerr << errors;
+        }
+    }
+
+    bool undefinedSymbols = false;
+    for (auto errors: undefinedErrors) {
+        if (!errors.empty()) {
+            undefinedSymbols = true;
+            std::cerr << errors;
+        }
+    }
+
+    if (!symbols.find("__main", SymbolTable::hash("__main"), entrySymbol)) {
+        std::cerr << fileName << ":(.text+0x0): undefined symbol '__main'" << std::endl;
+        undefinedSymbols = true;
+    }
+    else {
+        auto entryFile = files[entrySymbol.file];
+        exSegment.push_back(entryFile->getSection(getSymbol(entrySymbol).header.st_shndx));
+    }
+
+    if (duplicateSymbols || undefinedSymbols) {
+        return false;
+    }
+
+    return true;
+}
+
+bool Linker::collectGarbage(std::vector<std::string> keepSymbols) {
+    // a section is an index into its file's section table
+    std::vector<std::vector<uint8_t>> live(files.size());
+    std::vector<std::vector<std::vector<std::shared_ptr<libelf::Section>>>> tables(files.size());
+    for (size_t f = 0; f < files.size(); f++) {
+        live[f].resize(files[f]->sectionCount(), false);
+        tables[f].resize(files[f]->sectionCount());
+        for (auto table: files[f]->findSections(SHT_REL)) {
+            if (table->header.sh_info < tables[f].size()) {
+                tables[f][table->header.sh_info].push_back(table);
+            }
+        }
+    }
+
+    std::vector<std::pair<size_t, Elf32_Word>> pending;
+    auto mark = [&](size_t file, Elf32_Word index) {
+        if (index == SHN_UNDEF || index >= live[file].size() || live[file][index]) {
+            return;
+        }
+        live[file][index] = true;
+        pending.push_back({file, index});
+    };
+
+    // roots: the entry point, anything asked for by name, and anything
+    // flagged as retained
+    mark(entrySymbol.file, getSymbol(entrySymbol).header.st_shndx);
+
+    bool keptAll = true;
+    for (auto& name: keepSymbols) {
+        bool found = false;
+        for (size_t f = 0; f < files.size(); f++) {
+            for (auto& symbol: symbolTables[f]->symbols) {
+                if (symbol.name == name && symbol.isDefined()) {
+                    mark(f, symbol.header.st_shndx);
+                    found = true;
+                }
+            }
+        }
+        if (!found) {
+            std::cerr << fileName << ": cannot keep undefined symbol '" << name << "'" << std::endl;
+            keptAll = false;
+        }
+    }
+    if (!keptAll) {
+        return false;
+    }
+
+    for (size_t f = 0; f < files.size(); f++) {
+        for (Elf32_Word i = 0; i < files[f]->sectionCount(); i++) {
+            if (files[f]->getSection(i)->header.sh_flags & SHF_GNU_RETAIN) {
+                mark(f, i);
+            }
+        }
+    }
+
+    // follow relocations from live sections to the sections they refer to
+    while (!pending.empty()) {
+        auto [f, index] = pending.back();
+        pending.pop_back();
+
+        for (auto table: tables[f][index]) {
+            for (auto& relocation: table->relocations) {
+                auto target = resolvedSymbols[f][relocation.symbol];
+                auto& symbol = getSymbol(target);
+                if (symbol.isDefined()) {
+                    mark(target.file, symbol.header.st_shndx);
+                }
+            }
+        }
+    }
+
+    for (size_t f = 0; f < files.size(); f++) {
+        for (Elf32_Word i = 0; i < files[f]->sectionCount(); i++) {
+            auto section = files[f]->getSection(i);
+            if (live[f][i] || !(section->isProgBits() || section->isNoBits())) {
+                continue;
+            }
+            discardedSections.insert(section);
+            std::cout << fileName << ": removing unused section '" << section->name << "' (" << section->header.sh_size << " bytes) in file '" << files[f]->getFileName() << "'" << std::endl;
+        }
+    }
+
+    return true;
+}
+
+// A relocation as seen by section folding: the place it patches, and
+// what it points at, either another candidate or some other section.
+struct FoldingEdge {
+    Elf32_Word offset;
+    uint8_t type;
+    long candidate;
+    libelf::Section *section;
+    Elf32_Word value;
+};
+
+size_t combineHash(size_t seed, size_t value) {
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+bool Linker::foldIdenticalSections() {
+    struct Candidate {
+        size_t file;
+        std::shared_ptr<libelf::Section> section;
+        std::vector<FoldingEdge> edges;
+    };
+
+    // only read-only contents can be shared
+    std::vector<Candidate> candidates;
+    std::vector<std::vector<long>> candidateIndex(files.size());
+    for (size_t f = 0; f < files.size(); f++) {
+        candidateIndex[f].resize(files[f]->sectionCount(), -1);
+        for (Elf32_Word i = 0; i < files[f]->sectionCount(); i++) {
+            auto section = files[f]->getSection(i);
+            if (!section->isProgBits() || !section->isReadOnly() || section->header.sh_size == 0) {
+                continue;
+            }
+            // merged piece by piece later instead
+            if (section->header.sh_flags & SHF_MERGE) {
+                continue;
+            }
+            if (discardedSections.contains(section)) {
+                continue;
+            }
+            candidateIndex[f][i] = candidates.size();
+            candidates.push_back({f, section, {}});
+        }
+    }
+
+    std::vector<std::vector<std::vector<std::shared_ptr<libelf::Section>>>> tables(files.size());
+    for (size_t f = 0; f < files.size(); f++) {
+        tables[f].resize(files[f]->sectionCount());
+        for (auto table: files[f]->findSections(SHT_REL)) {
+            if (table->header.sh_info < tables[f].size()) {
+                tables[f][table->header.sh_info].push_back(table);
+            }
+        }
+    }
+
+    // Contents, shape and anything pointing outside the candidates never
+    // change, so they are compared once; the classes of the candidates
+    // pointed at are refined below.
+    std::vector<size_t> hashes(candidates.size());
+    parallelFor(candidates.size(), [&](size_t c) {
+        auto& candidate = candidates[c];
+        auto& section = candidate.section;
+
+        for (auto table: tables[candidate.file][section->index]) {
+            for (auto& relocation: table->relocations) {
+                auto target = resolvedSymbols[candidate.file][relocation.symbol];
+                auto& symbol = getSymbol(target);
+
+                FoldingEdge edge = {relocation.offset, relocation.type, -1, 0, symbol.header.st_value};
+                if (symbol.isDefined() && symbol.header.st_shndx < candidateIndex[target.file].size()) {
+                    edge.candidate = candidateIndex[target.file][symbol.header.st_shndx];
+                    edge.section = files[target.file]->getSection(symbol.header.st_shndx).get();
+                }
+                else {
+                    edge.value = symbolAddress(target);
+                }
+                candidate.edges.push_back(edge);
+            }
+        }
+        std::stable_sort(candidate.edges.begin(), candidate.edges.end(), [](const FoldingEdge& a, const FoldingEdge& b) {
+            return a.offset < b.offset;
+        });
+
+        size_t hash = std::hash<std::string_view>()(std::string_view(section->data, section->header.sh_size));
+        hash = combineHash(hash, section->header.sh_flags);
+        for (auto& edge: candidate.edges) {
+            hash = combineHash(hash, edge.offset);
+            hash = combineHash(hash, edge.type);
+            hash = combineHash(hash, edge.value);
+            if (edge.candidate < 0) {
+                hash = combineHash(hash, (size_t) edge.section);
+            }
+        }
+        hashes[c] = hash;
+    });
+
+    auto sameShape = [&](const Candidate& a, const Candidate& b) {
+        if (a.section->header.sh_size != b.section->header.sh_size || a.section->header.sh_flags != b.section->header.sh_flags) {
             return false;
         }
-        if (!inFile->readRelocations()) {
+        if (a.section->header.sh_addralign != b.section->header.sh_addralign || a.edges.size() != b.edges.size()) {
             return false;
         }
-        if (!inFile->readProgBits()) {
+        if (std::memcmp(a.section->data, b.section->data, a.section->header.sh_size) != 0) {
             return false;
         }
+        for (size_t e = 0; e < a.edges.size(); e++) {
+            auto& x = a.edges[e];
+            auto& y = b.edges[e];
+            if (x.offset != y.offset || x.type != y.type || x.value != y.value) {
+                return false;
+            }
+            if ((x.candidate < 0 || y.candidate < 0) && x.section != y.section) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // Start by assuming candidates that point at each other are equal and
+    // split classes until nothing changes, so that identical sections
+    // referring to each other (recursion, say) still fold.
+    std::vector<size_t> classes(candidates.size());
+    size_t classCount = 0;
+    auto partition = [&](auto equal) {
+        std::unordered_map<size_t, std::vector<size_t>> buckets;
+        std::vector<size_t> refined(candidates.size());
+        size_t count = 0;
+        for (size_t c = 0; c < candidates.size(); c++) {
+            auto& bucket = buckets[hashes[c]];
+            auto match = std::find_if(bucket.begin(), bucket.end(), [&](size_t other) {
+                return equal(c, other);
+            });
+            if (match != bucket.end()) {
+                refined[c] = refined[*match];
+                continue;
+            }
+            refined[c] = count++;
+            bucket.push_back(c);
+        }
+        classes = refined;
+        return count;
+    };
+
+    classCount = partition([&](size_t a, size_t b) {
+        return sameShape(candidates[a], candidates[b]);
+    });
+
+    while (true) {
+        parallelFor(candidates.size(), [&](size_t c) {
+            size_t hash = classes[c];
+            for (auto& edge: candidates[c].edges) {
+                if (edge.candidate >= 0) {
+                    hash = combineHash(hash, classes[edge.candidate]);
+                }
+            }
+            hashes[c] = hash;
+        });
 
-        files.push_back(inFile);
+        auto previous = classes;
+        auto count = partition([&](size_t a, size_t b) {
+            if (previous[a] != previous[b]) {
+                return false;
+            }
+            auto& x = candidates[a].edges;
+            auto& y = candidates[b].edges;
+            for (size_t e = 0; e < x.size(); e++) {
+                if (x[e].candidate >= 0 && previous[x[e].candidate] != previous[y[e].candidate]) {
+                    return false;
+                }
+            }
+            return true;
+        });
+
+        // classes only ever split, so an unchanged count means stable
+        if (count == classCount) {
+            break;
+        }
+        classCount = count;
+    }
+
+    // the first of each class stays, unless another holds the entry point
+    std::vector<long> keepers(classCount, -1);
+    auto entrySection = exSegment[0];
+    for (size_t c = 0; c < candidates.size(); c++) {
+        if (keepers[classes[c]] < 0 || candidates[c].section == entrySection) {
+            keepers[classes[c]] = c;
+        }
+    }
+
+    for (size_t c = 0; c < candidates.size(); c++) {
+        auto keeper = keepers[classes[c]];
+        if ((size_t) keeper == c) {
+            continue;
+        }
+        auto& folded = candidates[c];
+        auto& kept = candidates[keeper];
+
+        discardedSections.insert(folded.section);
+        foldedSections.push_back({folded.section, kept.section});
+        std::cout << fileName << ": folding section '" << folded.section->name << "' in file '" << files[folded.file]->getFileName() << "' into '" << kept.section->name << "' in file '" << files[kept.file]->getFileName() << "'" << std::endl;
     }
 
     return true;
 }
 
-bool Linker::resolveReferences() {
-    std::map<std::string, std::shared_ptr<libelf::Symbol>> symbols;
+bool Linker::mergeSections() {
+    // inputs carrying relocations of their own are laid out as they are
+    std::set<libelf::Section *> relocated;
+    for (auto file: files) {
+        for (auto table: file->findSections(SHT_REL)) {
+            relocated.insert(file->getSection(table->header.sh_info).get());
+        }
+    }
 
-    bool duplicateSymbols = false;
     for (auto file: files) {
-        auto symbolTable = file->findSection(SHT_SYMTAB);
+        for (auto section: file->findSections(SHT_PROGBITS)) {
+            if (!(section->header.sh_flags & SHF_MERGE) || !section->isReadOnly() || section->isExecutable()) {
+                continue;
+            }
+            if (discardedSections.contains(section) || relocated.contains(section.get())) {
+                continue;
+            }
+
+            auto merged = std::find_if(mergedSections.begin(), mergedSections.end(), [&](auto& merged) {
+                return merged->accepts(section->header);
+            });
+            if (merged == mergedSections.end()) {
+                mergedSections.push_back(std::make_unique<MergedSection>(section->header));
+                merged = mergedSections.end() - 1;
+            }
+
+            mergedInputs[section.get()] = {merged->get(), (*merged)->addInput(section)};
+            discardedSections.insert(section);
+        }
+    }
+
+    for (auto& merged: mergedSections) {
+        merged->build();
+    }
 
-        for (auto symbol: symbolTable->symbols) {
-            // ignore undefined symbols at this point
-            if (!(symbol->section)) {
+    return true;
+}
+
+bool Linker::orderSections(bool useCallGraph, std::string profileFileName, std::string orderingFileName) {
+    // the definition each name resolved to, and the section it is in
+    std::unordered_map<std::string_view, SymbolReference> definitions;
+    for (Elf32_Word f = 0; f < files.size(); f++) {
+        for (Elf32_Word s = 0; s < symbolTables[f]->symbols.size(); s++) {
+            auto& symbol = symbolTables[f]->symbols[s];
+            if (!symbol.isDefined() || symbol.name.empty()) {
                 continue;
             }
+            // a global name means the global; a local one, the first found
+            if (symbol.isLocal()) {
+                definitions.try_emplace(symbol.name, SymbolReference{f, s});
+            }
+            else {
+                definitions.insert_or_assign(symbol.name, SymbolReference{f, s});
+            }
+        }
+    }
 
-            if (symbols.contains(symbol->name)) {
-                duplicateSymbols = true;
-                std::cerr << file->getFileName() << ": multiple definition of symbol '" << symbol->name << "'" << std::endl;
+    // folded sections are placed as the copy that was kept
+    std::unordered_map<libelf::Section *, std::shared_ptr<libelf::Section>> standIns;
+    for (auto& fold: foldedSections) {
+        standIns[fold.first.get()] = fold.second;
+    }
+    auto placedSection = [&](SymbolReference reference) {
+        std::shared_ptr<libelf::Section> section;
+        auto& symbol = getSymbol(reference);
+        if (symbol.header.st_shndx >= files[reference.file]->sectionCount()) {
+            return section;
+        }
+        section = files[reference.file]->getSection(symbol.header.st_shndx);
+        if (standIns.contains(section.get())) {
+            return standIns[section.get()];
+        }
+        if (discardedSections.contains(section)) {
+            section.reset();
+        }
+        return section;
+    };
+    auto definingSection = [&](std::string_view name) {
+        auto definition = definitions.find(name);
+        if (definition == definitions.end()) {
+            return std::shared_ptr<libelf::Section>();
+        }
+        return placedSection(definition->second);
+    };
+
+    size_t priority = 0;
+
+    // an explicit order comes before anything worked out here
+    if (!orderingFileName.empty()) {
+        std::ifstream orderingFile(orderingFileName);
+        if (!orderingFile.is_open()) {
+            std::cerr << orderingFileName << ": cannot open symbol ordering file" << std::endl;
+            return false;
+        }
+
+        std::string name;
+        while (orderingFile >> name) {
+            auto section = definingSection(name);
+            if (!section) {
+                std::cerr << orderingFileName << ": warning: symbol '" << name << "' is not defined in any section placed" << std::endl;
                 continue;
             }
+            sectionPriority.try_emplace(section.get(), priority++);
+        }
+    }
 
-            symbols[symbol->name] = symbol;
+    if (!useCallGraph && profileFileName.empty()) {
+        return true;
+    }
+
+    Elf32_Word pageSize = 4096;
+    for (auto file: files) {
+        for (auto section: file->findSections(SHT_LOPROC)) {
+            if (section->name == ".pagesize" && section->header.sh_addr > 0) {
+                pageSize = section->header.sh_addr;
+            }
         }
     }
 
-    bool undefinedSymbols = false;
+    CallGraph graph;
+    std::unordered_map<libelf::Section *, size_t> nodes;
+    std::vector<std::shared_ptr<libelf::Section>> nodeSections;
     for (auto file: files) {
-        std::set<std::string> previouslyUndefinedSymbols;
-        auto sections = file->findSections(SHT_REL);
-        for (auto section: sections) {
-            for (auto relocation: section->relocations) {
-                auto symbol = relocation->symbol;
-                auto relSection = file->getSection(section->header.sh_info);
-                if (symbols.contains(symbol->name)) {
-                    auto reference = symbols[symbol->name];
-                    relocation->symbol = reference;
-                }
-                else if (!previouslyUndefinedSymbols.contains(symbol->name)) {
-                    previouslyUndefinedSymbols.insert(symbol->name);
-                    undefinedSymbols = true;
-                    std::cerr << file->getFileName() << ":(" << relSection->name << "+0x" << std::hex << relocation->offset << std::dec << "): undefined symbol '" << symbol->name << "'" << std::endl;
-                }
+        for (auto section: file->findSections(SHT_PROGBITS)) {
+            if (!section->isExecutable() || discardedSections.contains(section)) {
+                continue;
             }
+            nodes[section.get()] = graph.addSection(section->header.sh_size);
+            nodeSections.push_back(section);
         }
     }
 
-    if (!symbols.contains("__main")) {
-        std::cerr << fileName << ":(.text+0x0): undefined symbol '__main'" << std::endl;
-        undefinedSymbols = true;
+    if (!profileFileName.empty()) {
+        // one "<caller> <callee> <count>" per line, by symbol name
+        std::ifstream profileFile(profileFileName);
+        if (!profileFile.is_open()) {
+            std::cerr << profileFileName << ": cannot open call graph profile" << std::endl;
+            return false;
+        }
+
+        std::string caller;
+        std::string callee;
+        uint64_t count;
+        while (profileFile >> caller >> callee >> count) {
+            auto from = definingSection(caller);
+            auto to = definingSection(callee);
+            if (from && to && nodes.contains(from.get()) && nodes.contains(to.get())) {
+                graph.addCall(nodes[from.get()], nodes[to.get()], count);
+            }
+        }
     }
     else {
-        entrySymbol = symbols["__main"];
-        exSegment.push_back(entrySymbol->section);
+        // without a profile, every jump or call site counts once
+        for (size_t f = 0; f < files.size(); f++) {
+            for (auto table: files[f]->findSections(SHT_REL)) {
+                auto from = nodes.find(files[f]->getSection(table->header.sh_info).get());
+                if (from == nodes.end()) {
+                    continue;
+                }
+                for (auto& relocation: table->relocations) {
+                    if (relocation.type != N16R_REL_JMP) {
+                        continue;
+                    }
+                    auto to = placedSection(resolvedSymbols[f][relocation.symbol]);
+                    if (to && nodes.contains(to.get())) {
+                        graph.addCall(from->second, nodes[to.get()], 1);
+                    }
+                }
+            }
+        }
     }
 
-    if (duplicateSymbols || undefinedSymbols) {
-        return false;
+    for (auto node: graph.order(pageSize)) {
+        sectionPriority.try_emplace(nodeSections[node].get(), priority++);
     }
 
     return true;
@@ -101,12 +868,7 @@ void ensureAlignment(uint32_t& value, uint32_t alignment) {
 }
 
 bool Linker::positionSegments() {
-    int exSize = 0;
-    int roSize = 0;
-    int rwSize = 0;
-    int zeSize = 0;
-
-    Elf32_Addr pageSize = 0;
+    pageSize = 0;
 
     // exe progbits containing __main   (.text)
     // exe progbits                     (.text)
@@ -115,27 +877,25 @@ bool Linker::positionSegments() {
     // rw nobits                        (.bss)
     for (auto file: files) {
         for (auto section: file->findSections(SHT_NULL)) {
+            if (discardedSections.contains(section)) {
+                continue;
+            }
             if (section == exSegment[0]) {
-                exSize += section->header.sh_size;
                 continue;
             }
             else if (section->isNoBits()) {
                 if (!section->isReadOnly()) {
-                    zeSize += section->header.sh_size;
                     zeSegment.push_back(section);
                 }
             }
             else if (section->isProgBits()) {
                 if (section->isExecutable()) {
-                    exSize += section->header.sh_size;
                     exSegment.push_back(section);
                 }
                 else if (section->isReadOnly()) {
-                    roSize += section->header.sh_size;
                     roSegment.push_back(section);
                 }
                 else {
-                    rwSize += section->header.sh_size;
                     rwSegment.push_back(section);
                 }
             }
@@ -147,11 +907,56 @@ bool Linker::positionSegments() {
         }
     }
 
+    // sections given an order come first, in that order; the section
+    // holding __main stays at the very front
+    if (!sectionPriority.empty()) {
+        auto byPriority = [&](const std::shared_ptr<libelf::Section>& a, const std::shared_ptr<libelf::Section>& b) {
+            auto x = sectionPriority.find(a.get());
+            auto y = sectionPriority.find(b.get());
+            return (x == sectionPriority.end() ? SIZE_MAX : x->second) < (y == sectionPriority.end() ? SIZE_MAX : y->second);
+        };
+        std::stable_sort(exSegment.begin() + 1, exSegment.end(), byPriority);
+        std::stable_sort(roSegment.begin(), roSegment.end(), byPriority);
+        std::stable_sort(rwSegment.begin(), rwSegment.end(), byPriority);
+        std::stable_sort(zeSegment.begin(), zeSegment.end(), byPriority);
+    }
+
+    // merged constants and strings go after everything else read-only
+    for (auto& merged: mergedSections) {
+        roSegment.push_back(merged->output);
+    }
+
     // put the ephemeral parts at the end of the rw segment
     for (auto section: zeSegment) {
         //rwSegment.push_back(section);
     }
 
+    // the first section of each segment gives where it starts; taken
+    // before any addresses are assigned, so layout can be redone
+    exStart = exSegment[0]->header.sh_addr;
+    roAlignment = roSegment.empty() ? 0 : roSegment[0]->header.sh_addr;
+    rwAlignment = rwSegment.empty() ? 0 : rwSegment[0]->header.sh_addr;
+    zeAlignment = zeSegment.empty() ? 0 : zeSegment[0]->header.sh_addr;
+
+    assignAddresses();
+
+    return true;
+}
+
+Elf32_Word segmentSize(std::vector<std::shared_ptr<libelf::Section>>& segment) {
+    Elf32_Word size = 0;
+    for (auto section: segment) {
+        size += section->header.sh_size;
+    }
+    return size;
+}
+
+void Linker::assignAddresses() {
+    auto exSize = segmentSize(exSegment);
+    auto roSize = segmentSize(roSegment);
+    auto rwSize = segmentSize(rwSegment);
+    auto zeSize = segmentSize(zeSegment);
+
     segmentCount = 0;
     if (exSize > 0) {
         segmentCount++;
@@ -163,7 +968,7 @@ bool Linker::positionSegments() {
         segmentCount++;
     }
 
-    uint32_t memoryOffset = exSegment[0]->header.sh_addr + sizeof(Elf32_Ehdr) + segmentCount * sizeof(Elf32_Phdr);
+    uint32_t memoryOffset = exStart + sizeof(Elf32_Ehdr) + segmentCount * sizeof(Elf32_Phdr);
 
     for (auto segment: exSegment) {
         ensureAlignment(memoryOffset, segment->header.sh_addralign);
@@ -174,7 +979,7 @@ bool Linker::positionSegments() {
     }
 
     if (roSize > 0) {
-        ensureAlignment(memoryOffset, roSegment[0]->header.sh_addr);
+        ensureAlignment(memoryOffset, roAlignment);
     }
 
     for (auto segment: roSegment) {
@@ -187,10 +992,10 @@ bool Linker::positionSegments() {
     if (rwSize > 0 || zeSize > 0) {
         ensureAlignment(memoryOffset, pageSize);
         if (rwSize > 0) {
-            ensureAlignment(memoryOffset, rwSegment[0]->header.sh_addr);
+            ensureAlignment(memoryOffset, rwAlignment);
         }
         if (zeSize > 0) {
-            ensureAlignment(memoryOffset, zeSegment[0]->header.sh_addr);
+            ensureAlignment(memoryOffset, zeAlignment);
         }
     }
 
@@ -208,54 +1013,341 @@ bool Linker::positionSegments() {
         memoryOffset += segment->header.sh_size;
     }
 
-    return true;
+    // symbols in a folded section now land on the copy that was kept
+    for (auto& fold: foldedSections) {
+        fold.first->header.sh_addr = fold.second->header.sh_addr;
+    }
 }
 
-bool Linker::relocateSegments() {
-    for (auto file: files) {
-        auto sections = file->findSections(SHT_REL);
-        for (auto section: sections) {
-            for (auto relocation: section->relocations) {
-                auto offset = relocation->offset;
-                auto value = relocation->symbol->address();
-                auto data = relocation->section->data;
-                uint8_t byte = 0;
-
-                switch (relocation->type) {
-                    case N16R_REL_JMP:
-                        value = value >> 1;
-                        data[offset + 3] = (value & 0xff);
-                        value >>= 8;
-                        data[offset + 2] = (value & 0xff);
-                        value >>= 8;
-                        data[offset + 1] = (value & 0xff);
-                        value >>= 8;
-                        data[offset] = (data[offset] & 0xf0) | (value & 0x0f);
-                        break;
-                    case N16R_REL_B3:
-                        byte++;
-                    case N16R_REL_B2:
-                        byte++;
-                    case N16R_REL_B1:
-                        byte++;
-                    case N16R_REL_B0:
-                        data[offset] = (value >> byte) & 0xff;
-                        break;
-                    default:
+// Where an offset into a section moves to once deletions are made.
+Elf32_Word shiftedOffset(const std::vector<Deletion>& deletions, Elf32_Word offset) {
+    auto after = std::upper_bound(deletions.begin(), deletions.end(), offset, [](Elf32_Word offset, const Deletion& deletion) {
+        return offset < deletion.offset;
+    });
+    if (after == deletions.begin()) {
+        return offset;
+    }
+
+    auto& deletion = *(after - 1);
+    if (offset < deletion.offset + deletion.size) {
+        // inside deleted bytes: whatever comes next
+        return deletion.offset - deletion.removedBefore;
+    }
+    return offset - deletion.removedBefore - deletion.size;
+}
+
+bool Linker::relaxSections() {
+    // a relocation that could let bytes be deleted
+    struct Site {
+        Elf32_Word symbol;
+        Elf32_Word offset;
+        const RelocationKernel *kernel;
+        const libelf::RelaxationRule *rule;
+    };
+    struct Relaxable {
+        size_t file;
+        std::shared_ptr<libelf::Section> section;
+        Elf32_Word originalSize;
+        std::vector<Site> sites;
+        // spans the assembler resolved itself, so must not change length
+        std::vector<std::pair<Elf32_Word, Elf32_Word>> fixedSpans;
+    };
+
+    std::set<libelf::Section *> keptCopies;
+    for (auto& fold: foldedSections) {
+        keptCopies.insert(fold.second.get());
+    }
+
+    std::vector<Relaxable> relaxables;
+    for (size_t f = 0; f < files.size(); f++) {
+        std::map<Elf32_Word, size_t> fileRelaxables;
+        for (auto table: files[f]->findSections(SHT_REL)) {
+            auto index = table->header.sh_info;
+            auto section = files[f]->getSection(index);
+            if (!section->isExecutable() || discardedSections.contains(section) || keptCopies.contains(section.get())) {
+                continue;
+            }
+            if (section->header.sh_flags & SHF_NP_ALIGNED) {
+                continue;
+            }
+            if (!fileRelaxables.contains(index)) {
+                fileRelaxables[index] = relaxables.size();
+                relaxables.push_back({f, section, section->header.sh_size, {}, {}});
+            }
+            auto& relaxable = relaxables[fileRelaxables[index]];
+
+            for (auto& relocation: table->relocations) {
+                if (relocation.type == 0) {
+                    auto& symbol = symbolTables[f]->symbols[relocation.symbol];
+                    if (symbol.header.st_shndx == index) {
+                        auto from = std::min(relocation.offset, symbol.header.st_value);
+                        auto to = std::max(relocation.offset, symbol.header.st_value);
+                        relaxable.fixedSpans.push_back({from, to});
+                    }
+                    continue;
+                }
+
+                auto kernel = relocationTables[f].find(relocation.type);
+                auto rule = relocationTables[f].findRelaxation(relocation.type);
+                if (kernel && rule) {
+                    relaxable.sites.push_back({relocation.symbol, relocation.offset, kernel, rule});
+                }
+            }
+        }
+    }
+
+    for (auto& relaxable: relaxables) {
+        std::sort(relaxable.sites.begin(), relaxable.sites.end(), [](const Site& a, const Site& b) {
+            return a.offset < b.offset;
+        });
+    }
+
+    // Decide against the current layout, lay out again, and repeat until
+    // the same bytes come out deletable twice running. Deletions move code
+    // and can change the values that allowed them, so a layout is only
+    // final once it justifies itself.
+    const int MAX_PASSES = 16;
+    bool converged = false;
+    int pass = 0;
+    for (; pass < MAX_PASSES && !converged; pass++) {
+        std::vector<std::vector<Deletion>> next(relaxables.size());
+        parallelFor(relaxables.size(), [&](size_t r) {
+            auto& relaxable = relaxables[r];
+            auto& resolved = resolvedSymbols[relaxable.file];
+            auto current = sectionDeletions.find(relaxable.section.get());
+            auto sectionAddress = relaxable.section->header.sh_addr;
+            auto& deletions = next[r];
+
+            for (auto& site: relaxable.sites) {
+                Elf32_Word place = site.offset;
+                if (current != sectionDeletions.end()) {
+                    place = shiftedOffset(current->second, place);
+                }
+                if (site.rule->condition != RELAX_IF_ZERO || site.kernel->value(symbolAddress(resolved[site.symbol]), sectionAddress + place) != 0) {
+                    continue;
+                }
+
+                long start = (long) site.offset + site.rule->start;
+                Elf32_Word size = site.rule->size;
+                if (start < 0 || start + size > relaxable.originalSize) {
+                    continue;
+                }
+                if (!deletions.empty() && start < deletions.back().offset + deletions.back().size) {
+                    continue;
+                }
+
+                bool fixed = false;
+                for (auto& span: relaxable.fixedSpans) {
+                    if (start < span.second && start + size > span.first) {
+                        fixed = true;
                         break;
+                    }
                 }
+                if (fixed) {
+                    continue;
+                }
+
+                Elf32_Word removedBefore = deletions.empty() ? 0 : deletions.back().removedBefore + deletions.back().size;
+                deletions.push_back({(Elf32_Word) start, size, removedBefore});
+            }
+        });
+
+        static const std::vector<Deletion> none;
+        converged = true;
+        for (size_t r = 0; r < relaxables.size(); r++) {
+            auto current = sectionDeletions.find(relaxables[r].section.get());
+            auto& previous = current == sectionDeletions.end() ? none : current->second;
+            if (previous.size() != next[r].size() || !std::equal(previous.begin(), previous.end(), next[r].begin(), [](const Deletion& a, const Deletion& b) {
+                return a.offset == b.offset && a.size == b.size;
+            })) {
+                converged = false;
+                break;
             }
         }
+        if (converged) {
+            break;
+        }
+
+        sectionDeletions.clear();
+        for (size_t r = 0; r < relaxables.size(); r++) {
+            auto& relaxable = relaxables[r];
+            Elf32_Word removed = next[r].empty() ? 0 : next[r].back().removedBefore + next[r].back().size;
+            relaxable.section->header.sh_size = relaxable.originalSize - removed;
+            if (!next[r].empty()) {
+                sectionDeletions[relaxable.section.get()] = std::move(next[r]);
+            }
+        }
+        assignAddresses();
     }
 
+    if (!converged) {
+        std::cerr << fileName << ": warning: relaxation did not settle after " << MAX_PASSES << " passes; not relaxing" << std::endl;
+        sectionDeletions.clear();
+        for (auto& relaxable: relaxables) {
+            relaxable.section->header.sh_size = relaxable.originalSize;
+        }
+        assignAddresses();
+        return true;
+    }
+
+    // make the deletions real: contents, symbols and relocations
+    std::vector<Elf32_Word> removed(relaxables.size(), 0);
+    parallelFor(relaxables.size(), [&](size_t r) {
+        auto& relaxable = relaxables[r];
+        auto found = sectionDeletions.find(relaxable.section.get());
+        if (found == sectionDeletions.end()) {
+            return;
+        }
+        auto& deletions = found->second;
+        auto section = relaxable.section;
+        auto file = files[relaxable.file];
+
+        char *data = new char[section->header.sh_size];
+        Elf32_Word kept = 0;
+        Elf32_Word offset = 0;
+        for (auto& deletion: deletions) {
+            std::memcpy(data + kept, section->data + offset, deletion.offset - offset);
+            kept += deletion.offset - offset;
+            offset = deletion.offset + deletion.size;
+        }
+        std::memcpy(data + kept, section->data + offset, relaxable.originalSize - offset);
+        section->takeData(data, section->header.sh_size);
+        removed[r] = relaxable.originalSize - section->header.sh_size;
+
+        for (auto& symbol: symbolTables[relaxable.file]->symbols) {
+            if (symbol.header.st_shndx == section->index) {
+                symbol.header.st_value = shiftedOffset(deletions, symbol.header.st_value);
+            }
+        }
+
+        for (auto table: file->findSections(SHT_REL)) {
+            if (table->header.sh_info != section->index) {
+                continue;
+            }
+            std::erase_if(table->relocations, [&](const libelf::Relocation& relocation) {
+                auto after = std::upper_bound(deletions.begin(), deletions.end(), relocation.offset, [](Elf32_Word offset, const Deletion& deletion) {
+                    return offset < deletion.offset;
+                });
+                return after != deletions.begin() && relocation.offset < (after - 1)->offset + (after - 1)->size;
+            });
+            for (auto& relocation: table->relocations) {
+                relocation.offset = shiftedOffset(deletions, relocation.offset);
+            }
+        }
+    });
+    sectionDeletions.clear();
+
+    Elf32_Word total = 0;
+    for (auto bytes: removed) {
+        total += bytes;
+    }
+    std::cout << fileName << ": relaxation removed " << total << " bytes in " << pass + 1 << " passes" << std::endl;
+
     return true;
 }
 
+// A relocation with its value already computed.
+struct Fixup {
+    Elf32_Word offset;
+    Elf32_Word value;
+    const RelocationKernel *kernel;
+};
+
+bool Linker::relocateSegments() {
+    // the final address of every symbol each file refers to, looked up once
+    std::vector<std::vector<Elf32_Word>> addresses(files.size());
+    parallelFor(files.size(), [&](size_t f) {
+        auto& resolved = resolvedSymbols[f];
+        addresses[f].resize(resolved.size());
+        for (Elf32_Word s = 0; s < resolved.size(); s++) {
+            addresses[f][s] = symbolAddress(resolved[s]);
+        }
+    });
+
+    // group relocation tables by the section they patch
+    struct Target {
+        size_t file;
+        std::shared_ptr<libelf::Section> section;
+        std::vector<std::shared_ptr<libelf::Section>> tables;
+    };
+    std::vector<Target> targets;
+    for (size_t f = 0; f < files.size(); f++) {
+        std::map<Elf32_Word, size_t> fileTargets;
+        for (auto table: files[f]->findSections(SHT_REL)) {
+            auto index = table->header.sh_info;
+            if (discardedSections.contains(files[f]->getSection(index))) {
+                continue;
+            }
+            if (!fileTargets.contains(index)) {
+                fileTargets[index] = targets.size();
+                targets.push_back({f, files[f]->getSection(index), {}});
+            }
+            targets[fileTargets[index]].tables.push_back(table);
+        }
+    }
+
+    // sections never overlap, so each one can be patched independently
+    std::vector<std::string> errors(targets.size());
+    parallelFor(targets.size(), [&](size_t t) {
+        auto& target = targets[t];
+        auto& fileAddresses = addresses[target.file];
+        auto& kernels = relocationTables[target.file];
+        auto sectionAddress = target.section->header.sh_addr;
+        auto sectionSize = target.section->header.sh_size;
+
+        std::vector<Fixup> fixups;
+        for (auto table: target.tables) {
+            fixups.reserve(fixups.size() + table->relocations.size());
+            for (auto& relocation: table->relocations) {
+                // type 0 marks a reference with nothing to patch
+                if (relocation.type == 0) {
+                    continue;
+                }
+
+                auto kernel = kernels.find(relocation.type);
+                if (!kernel) {
+                    errors[t] = files[target.file]->getFileName() + ":(" + target.section->name + "): unsupported relocation type " + std::to_string(relocation.type) + "\n";
+                    return;
+                }
+                // offsets come straight from the file, so nothing here may wrap
+                Elf32_Word span = kernel->byte + (kernel->bit + kernel->width + 7) / 8;
+                if (relocation.offset > sectionSize || span > sectionSize - relocation.offset) {
+                    errors[t] = files[target.file]->getFileName() + ":(" + target.section->name + "): relocation outside of section\n";
+                    return;
+                }
+
+                auto value = kernel->value(fileAddresses[relocation.symbol], sectionAddress + relocation.offset);
+                fixups.push_back({relocation.offset, value, kernel});
+            }
+        }
+
+        // walk the section front to back
+        std::stable_sort(fixups.begin(), fixups.end(), [](const Fixup& a, const Fixup& b) {
+            return a.offset < b.offset;
+        });
+
+        auto data = target.section->modifiableData();
+        for (auto& fixup: fixups) {
+            fixup.kernel->apply(data + fixup.offset, fixup.value, *fixup.kernel);
+        }
+    });
+
+    bool relocated = true;
+    for (auto error: errors) {
+        if (!error.empty()) {
+            std::cerr << error;
+            relocated = false;
+        }
+    }
+
+    return relocated;
+}
+
 bool Linker::generateOutputFile() {
     std::shared_ptr<libelf::Section> nullSection;
 
     outFile = std::make_shared<libelf::ElfFile>(ET_EXEC);
-    outFile->setEntryPoint(entrySymbol->address());
+    outFile->setEntryPoint(symbolAddress(entrySymbol));
 
     auto section = outFile->addSection(SHT_PROGBITS, nullSection, nullSection);
     section->name = ".text";
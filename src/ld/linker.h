@@ -3,19 +3,55 @@
 
 #include <string>
 #include <vector>
+#include <set>
+#include <unordered_map>
 
 #include "../libelf/elf.h"
+#include "../libelf/archive.h"
+#include "symboltable.h"
+#include "relocation.h"
+#include "merge.h"
 
 namespace ldnp {
 
+// Bytes removed from a section by relaxation, with the total removed
+// ahead of them.
+struct Deletion {
+    Elf32_Word offset;
+    Elf32_Word size;
+    Elf32_Word removedBefore;
+};
+
+// Everything optional about a link; what ldnp's flags turn on.
+struct LinkOptions {
+    bool outputRaw = false;
+    bool gcSections = false;
+    std::vector<std::string> keepSymbols;
+    bool foldSections = false;
+    bool relax = false;
+    bool callGraphOrder = false;
+    std::string profileFile;
+    std::string orderingFile;
+};
+
+bool parseLinkOption(const std::string&, LinkOptions&);
+
 class Linker {
     public:
         Linker(std::string _fileName): fileName(_fileName) {}
         ~Linker() {}
 
+        bool link(std::vector<std::string>, const LinkOptions&);
+
         bool loadFiles(std::vector<std::string>);
+        void addObject(std::string, std::shared_ptr<libelf::ElfFile>);
         bool resolveReferences();
+        bool collectGarbage(std::vector<std::string>);
+        bool foldIdenticalSections();
+        bool mergeSections();
+        bool orderSections(bool, std::string, std::string);
         bool positionSegments();
+        bool relaxSections();
         bool relocateSegments();
         bool generateOutputFile();
         bool writeOutputFile(bool);
@@ -23,15 +59,46 @@ class Linker {
         std::string fileName;
         std::shared_ptr<libelf::ElfFile> outFile;
 
-        std::shared_ptr<libelf::Symbol> entrySymbol;
+        SymbolReference entrySymbol;
+
+        std::vector<std::shared_ptr<libelf::Archive>> archives;
+        // objects built in memory, by the input name standing for each
+        std::unordered_map<std::string, std::shared_ptr<libelf::ElfFile>> builtObjects;
+        bool loadObjects(std::vector<std::shared_ptr<libelf::ElfFile>>);
+        bool loadArchiveMembers();
 
         std::vector<std::shared_ptr<libelf::ElfFile>> files;
+        std::vector<std::shared_ptr<libelf::Section>> symbolTables;
+        std::vector<RelocationTable> relocationTables;
+        // per file, the definition each of its symbols resolved to
+        std::vector<std::vector<SymbolReference>> resolvedSymbols;
+        // sections left out of the image by collectGarbage()
+        std::set<std::shared_ptr<libelf::Section>> discardedSections;
+        // discarded duplicates, and the copy that stands in for each
+        std::vector<std::pair<std::shared_ptr<libelf::Section>, std::shared_ptr<libelf::Section>>> foldedSections;
+        // SHF_MERGE inputs, and the merged section and input index for each
+        std::vector<std::unique_ptr<MergedSection>> mergedSections;
+        std::unordered_map<libelf::Section *, std::pair<MergedSection *, size_t>> mergedInputs;
+        // placement order for sections that were given one; the rest follow
+        std::unordered_map<libelf::Section *, size_t> sectionPriority;
+        // deletions under consideration while relaxing, by section
+        std::unordered_map<libelf::Section *, std::vector<Deletion>> sectionDeletions;
+
+        libelf::Symbol& getSymbol(SymbolReference);
+        Elf32_Word symbolAddress(SymbolReference);
 
         std::vector<std::shared_ptr<libelf::Section>> exSegment;
         std::vector<std::shared_ptr<libelf::Section>> roSegment;
         std::vector<std::shared_ptr<libelf::Section>> rwSegment;
         std::vector<std::shared_ptr<libelf::Section>> zeSegment;
         int segmentCount;
+
+        Elf32_Word pageSize;
+        Elf32_Addr exStart;
+        Elf32_Word roAlignment;
+        Elf32_Word rwAlignment;
+        Elf32_Word zeAlignment;
+        void assignAddresses();
 };
 
 }; // namespace ldnp
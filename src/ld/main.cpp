@@ -3,7 +3,9 @@
 #include "linker.h"
 
 void showUsage(std::string name) {
-    std::cerr << "Usage: " << name << " [-o <out-file>] [-s] [-r] <in-file> [<in-file> ... ]" << std::endl;
+    std::cerr << "Usage: " << name << " [-o <out-file>] [-s] [-r] [--gc-sections [--keep=<symbol> ...]] [--icf] [--relax]" << std::endl;
+    std::cerr << "       [--call-graph-order] [--call-graph-profile=<file>] [--symbol-ordering-file=<file>] <in-file> [<in-file> ... ]" << std::endl;
+    std::cerr << "  <in-file> is an object, or an archive whose members are loaded as needed" << std::endl;
 }
 
 int main(int argc, char **argv) {
@@ -15,10 +17,16 @@ int main(int argc, char **argv) {
     std::vector<std::string> inFiles;
     std::string outFile = "a.out";
     bool outputSymbols = false;
-    bool outputRaw = false;
+    ldnp::LinkOptions options;
 
     for (int i = 1; i < argc; i++) {
-        if (argv[i][0] == '-') {
+        if (argv[i][0] == '-' && argv[i][1] == '-') {
+            std::string option = argv[i];
+            if (!ldnp::parseLinkOption(option, options)) {
+                std::cout << "Warning: Unrecognized flag: '" << argv[i] << "'. Ignoring." << std::endl;
+            }
+        }
+        else if (argv[i][0] == '-') {
             switch (argv[i][1]) {
               case 'o': // set output file
                 i++;
@@ -30,7 +38,7 @@ int main(int argc, char **argv) {
                 outputSymbols = true;
                 break;
               case 'r': // 
-                outputRaw = true;
+                options.outputRaw = true;
                 break;
               default:
                 std::cout << "Warning: Unrecognized flag: '" << argv[i] << "'. Ignoring." << std::endl;
@@ -48,22 +56,7 @@ int main(int argc, char **argv) {
     }
 
     ldnp::Linker linker(outFile);
-    if (!linker.loadFiles(inFiles)) {
-        return -1;
-    }
-    if (!linker.resolveReferences()) {
-        return -1;
-    }
-    if (!linker.positionSegments()) {
-        return -1;
-    }
-    if (!linker.relocateSegments()) {
-        return -1;
-    }
-    if (!linker.generateOutputFile()) {
-        return -1;
-    }
-    if (!linker.writeOutputFile(outputRaw)) {
+    if (!linker.link(inFiles, options)) {
         return -1;
     }
     std::cout << "Done." << std::endl;
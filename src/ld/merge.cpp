@@ -0,0 +1,131 @@
+#include "merge.h"
+#include "parallel.h"
+
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+namespace ldnp {
+
+MergedSection::MergedSection(const Elf32_Shdr& header) {
+    output = std::make_shared<libelf::Section>();
+    output->header.sh_type = SHT_PROGBITS;
+    output->header.sh_flags = header.sh_flags;
+    output->header.sh_entsize = header.sh_entsize;
+    output->header.sh_addralign = header.sh_addralign;
+}
+
+bool MergedSection::accepts(const Elf32_Shdr& header) {
+    return header.sh_flags == output->header.sh_flags && header.sh_entsize == output->header.sh_entsize;
+}
+
+size_t MergedSection::addInput(std::shared_ptr<libelf::Section> section) {
+    if (inputs.empty()) {
+        output->name = section->name;
+        output->header.sh_addr = section->header.sh_addr;
+    }
+    output->header.sh_addralign = std::max(output->header.sh_addralign, section->header.sh_addralign);
+
+    inputs.push_back(section);
+    return inputs.size() - 1;
+}
+
+void MergedSection::build() {
+    bool strings = output->header.sh_flags & SHF_STRINGS;
+    Elf32_Word entrySize = std::max<Elf32_Word>(output->header.sh_entsize, 1);
+
+    // cut every input into pieces and hash them
+    pieces.resize(inputs.size());
+    parallelFor(inputs.size(), [&](size_t i) {
+        auto data = inputs[i]->data;
+        Elf32_Word size = inputs[i]->header.sh_size;
+        auto& inputPieces = pieces[i];
+
+        Elf32_Word offset = 0;
+        while (offset < size) {
+            Elf32_Word length = entrySize;
+            if (strings) {
+                auto end = (const char *) std::memchr(data + offset, 0, size - offset);
+                length = end ? end - (data + offset) + 1 : size - offset;
+            }
+            length = std::min(length, size - offset);
+
+            std::string_view piece(data + offset, length);
+            inputPieces.push_back({piece, std::hash<std::string_view>()(piece), offset, 0, 0});
+            offset += length;
+        }
+    });
+
+    // Each shard owns the pieces whose hash falls in it and sees them in
+    // input order, so the first copy of every piece leads without locking.
+    parallelFor(SHARD_COUNT, [&](size_t shard) {
+        std::unordered_map<std::string_view, Piece *> leaders;
+        for (auto& inputPieces: pieces) {
+            for (auto& piece: inputPieces) {
+                if (piece.hash % SHARD_COUNT != shard) {
+                    continue;
+                }
+                auto [leader, inserted] = leaders.try_emplace(piece.data, &piece);
+                piece.leader = leader->second;
+            }
+        }
+    });
+
+    std::vector<char> contents;
+    if (strings) {
+        // the builder puts the terminators back, and tail-merges
+        libelf::StringTableBuilder builder;
+        for (auto& inputPieces: pieces) {
+            for (auto& piece: inputPieces) {
+                if (piece.leader == &piece) {
+                    builder.add(piece.data.substr(0, piece.data.find('\0')));
+                }
+            }
+        }
+        builder.build();
+
+        for (auto& inputPieces: pieces) {
+            for (auto& piece: inputPieces) {
+                if (piece.leader == &piece) {
+                    piece.outputOffset = builder.getOffset(piece.data.substr(0, piece.data.find('\0')));
+                }
+            }
+        }
+        contents.assign(builder.data(), builder.data() + builder.size());
+    }
+    else {
+        for (auto& inputPieces: pieces) {
+            for (auto& piece: inputPieces) {
+                if (piece.leader == &piece) {
+                    piece.outputOffset = contents.size();
+                    contents.insert(contents.end(), piece.data.begin(), piece.data.end());
+                }
+            }
+        }
+    }
+
+    for (auto& inputPieces: pieces) {
+        for (auto& piece: inputPieces) {
+            piece.outputOffset = piece.leader->outputOffset;
+        }
+    }
+
+    output->data = new char[contents.size()];
+    std::memcpy(output->data, contents.data(), contents.size());
+    output->header.sh_size = contents.size();
+}
+
+Elf32_Word MergedSection::address(size_t input, Elf32_Word offset) {
+    auto& inputPieces = pieces[input];
+    auto after = std::upper_bound(inputPieces.begin(), inputPieces.end(), offset, [](Elf32_Word offset, const Piece& piece) {
+        return offset < piece.inputOffset;
+    });
+    if (after == inputPieces.begin()) {
+        return output->header.sh_addr + offset;
+    }
+
+    auto& piece = *(after - 1);
+    return output->header.sh_addr + piece.outputOffset + (offset - piece.inputOffset);
+}
+
+}; // namespace ldnp
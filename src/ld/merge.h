@@ -0,0 +1,46 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <string_view>
+#include <vector>
+#include <memory>
+
+#include "../libelf/elf.h"
+
+namespace ldnp {
+
+// The contents of every SHF_MERGE input section of one kind, cut into
+// pieces (NUL-terminated strings, or sh_entsize-byte constants) with each
+// distinct piece stored once in a single output section. Strings that are
+// the tail of a longer string share its bytes.
+class MergedSection {
+    public:
+        MergedSection(const Elf32_Shdr&);
+
+        bool accepts(const Elf32_Shdr&);
+        // returns the input's index, for address()
+        size_t addInput(std::shared_ptr<libelf::Section>);
+        void build();
+
+        // where an offset into an input section ended up
+        Elf32_Word address(size_t, Elf32_Word);
+
+        std::shared_ptr<libelf::Section> output;
+    private:
+        struct Piece {
+            std::string_view data;
+            size_t hash;
+            Elf32_Word inputOffset;
+            Elf32_Word outputOffset;
+            Piece *leader;
+        };
+
+        static const size_t SHARD_COUNT = 64;
+
+        std::vector<std::shared_ptr<libelf::Section>> inputs;
+        std::vector<std::vector<Piece>> pieces;
+};
+
+}; // namespace ldnp
+
+#endif
@@ -0,0 +1,58 @@
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+namespace ldnp {
+
+void parallelFor(size_t count, std::function<void(size_t)> task) {
+    size_t workerCount = std::thread::hardware_concurrency();
+    if (workerCount > count) {
+        workerCount = count;
+    }
+
+    if (workerCount <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next = 0;
+    std::exception_ptr failure;
+    std::mutex failureMutex;
+
+    auto work = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            try {
+                task(i);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(failureMutex);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+            }
+        }
+    };
+
+    // the calling thread does its share too
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < workerCount; i++) {
+        workers.emplace_back(work);
+    }
+    work();
+
+    for (auto& worker: workers) {
+        worker.join();
+    }
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+}; // namespace ldnp
@@ -0,0 +1,17 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstddef>
+#include <functional>
+
+namespace ldnp {
+
+// Runs task(0) .. task(count - 1) across the available cores and returns
+// once all of them have finished. Tasks are started in index order but
+// may finish in any order. The first exception thrown by a task is
+// rethrown here.
+void parallelFor(size_t, std::function<void(size_t)>);
+
+}; // namespace ldnp
+
+#endif
@@ -0,0 +1,100 @@
+#include "relocation.h"
+
+namespace ldnp {
+
+// Whole bytes, most significant first; covers the common 8/16/32 bit
+// byte-aligned fields without any masking.
+template <int BYTES>
+void applyBytes(char *place, Elf32_Word value, const RelocationKernel& kernel) {
+    place += kernel.byte;
+    for (int i = BYTES - 1; i >= 0; i--) {
+        place[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+// Any other field: merge it into the bytes it spans, most significant
+// bit first, keeping the neighbouring bits.
+void applyBits(char *place, Elf32_Word value, const RelocationKernel& kernel) {
+    uint8_t *data = (uint8_t *) place + kernel.byte;
+    int bit = kernel.bit;
+    int remaining = kernel.width;
+
+    while (remaining > 0) {
+        int available = 8 - bit;
+        int taken = available < remaining ? available : remaining;
+        int position = available - taken;
+
+        uint8_t mask = ((1 << taken) - 1) << position;
+        uint8_t bits = ((value >> (remaining - taken)) << position) & mask;
+        *data = (*data & ~mask) | bits;
+
+        remaining -= taken;
+        bit = 0;
+        data++;
+    }
+}
+
+bool RelocationTable::load(const std::vector<libelf::RelocationType>& types) {
+    for (auto& type: types) {
+        if (type.type == 0 || type.type > 0xff || type.width == 0 || type.width > 32 || type.shift > 31) {
+            return false;
+        }
+
+        RelocationKernel kernel;
+        kernel.shift = type.shift;
+        kernel.width = type.width;
+        kernel.byte = type.bit / 8;
+        kernel.bit = type.bit % 8;
+        kernel.pcRelative = type.flags & RELTYPE_PCREL;
+
+        kernel.mask = type.width == 32 ? 0xffffffff : (1u << type.width) - 1;
+        if (type.mask != 0) {
+            kernel.mask &= type.mask;
+        }
+
+        if (kernel.bit == 0 && kernel.width == 8) {
+            kernel.apply = applyBytes<1>;
+        }
+        else if (kernel.bit == 0 && kernel.width == 16) {
+            kernel.apply = applyBytes<2>;
+        }
+        else if (kernel.bit == 0 && kernel.width == 32) {
+            kernel.apply = applyBytes<4>;
+        }
+        else {
+            kernel.apply = applyBits;
+        }
+
+        kernels[type.type] = kernel;
+    }
+
+    return true;
+}
+
+// Objects written before asnp described its relocation types carry no
+// .reltypes section; they only ever held n16r code, with these types.
+bool RelocationTable::loadDefaults() {
+    return load({
+        // type          mask shift width bit flags
+        {N16R_REL_JMP,   0,   1,    28,   4,  0},
+        {N16R_REL_B0,    0,   0,     8,   0,  0},
+        {N16R_REL_B1,    0,   8,     8,   0,  0},
+        {N16R_REL_B2,    0,  16,     8,   0,  0},
+        {N16R_REL_B3,    0,  24,     8,   0,  0},
+    });
+}
+
+bool RelocationTable::loadRelaxations(const std::vector<libelf::RelaxationRule>& rules) {
+    for (auto& rule: rules) {
+        // a rule needs a relocation type to go with it
+        if (!kernels[rule.type].apply || rule.size == 0 || rule.condition != RELAX_IF_ZERO) {
+            return false;
+        }
+        relaxations[rule.type] = rule;
+    }
+
+    return true;
+}
+
+}; // namespace ldnp
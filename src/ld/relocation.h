@@ -0,0 +1,55 @@
+#ifndef RELOCATION_H
+#define RELOCATION_H
+
+#include <array>
+#include <vector>
+
+#include "../libelf/elf.h"
+
+namespace ldnp {
+
+struct RelocationKernel;
+typedef void (*RelocationFunction)(char *, Elf32_Word, const RelocationKernel&);
+
+// A relocation type compiled from its description: the value is prepared
+// by the linker, then stored by apply, which is picked for the field's
+// shape when the table is loaded.
+struct RelocationKernel {
+    RelocationFunction apply;
+    Elf32_Word mask;
+    uint8_t shift;
+    uint8_t width;
+    uint8_t byte;
+    uint8_t bit;
+    bool pcRelative;
+
+    Elf32_Word value(Elf32_Word symbol, Elf32_Word place) const {
+        if (pcRelative) {
+            symbol -= place;
+        }
+        return (symbol >> shift) & mask;
+    }
+};
+
+class RelocationTable {
+    public:
+        RelocationTable(): kernels({}), relaxations({}) {}
+
+        bool load(const std::vector<libelf::RelocationType>&);
+        bool loadDefaults();
+        const RelocationKernel *find(uint8_t type) const {
+            return kernels[type].apply ? &kernels[type] : 0;
+        }
+
+        bool loadRelaxations(const std::vector<libelf::RelaxationRule>&);
+        const libelf::RelaxationRule *findRelaxation(uint8_t type) const {
+            return relaxations[type].size ? &relaxations[type] : 0;
+        }
+    private:
+        std::array<RelocationKernel, 256> kernels;
+        std::array<libelf::RelaxationRule, 256> relaxations;
+};
+
+}; // namespace ldnp
+
+#endif
@@ -0,0 +1,29 @@
+#include "symboltable.h"
+
+namespace ldnp {
+
+bool SymbolTable::insert(std::string_view name, size_t hash, SymbolReference reference) {
+    auto& shard = shards[hash % SHARD_COUNT];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto [entry, inserted] = shard.symbols.try_emplace({name, hash}, reference);
+    if (!inserted && reference < entry->second) {
+        entry->second = reference;
+    }
+
+    return inserted;
+}
+
+bool SymbolTable::find(std::string_view name, size_t hash, SymbolReference& reference) {
+    auto& shard = shards[hash % SHARD_COUNT];
+
+    auto entry = shard.symbols.find({name, hash});
+    if (entry == shard.symbols.end()) {
+        return false;
+    }
+
+    reference = entry->second;
+    return true;
+}
+
+}; // namespace ldnp
@@ -0,0 +1,58 @@
+#ifndef SYMBOLTABLE_H
+#define SYMBOLTABLE_H
+
+#include <string_view>
+#include <unordered_map>
+#include <mutex>
+#include <array>
+
+#include "../libelf/elf.h"
+
+namespace ldnp {
+
+// A symbol in one of the input files, by position.
+struct SymbolReference {
+    Elf32_Word file;
+    Elf32_Word symbol;
+
+    bool operator==(const SymbolReference&) const = default;
+    bool operator<(const SymbolReference& other) const {
+        return file < other.file || (file == other.file && symbol < other.symbol);
+    }
+};
+
+// Defined symbols by name, split into independently locked shards so
+// input files can be entered from several threads at once. Callers pass
+// in the name's hash so it is computed only once per symbol.
+class SymbolTable {
+    public:
+        static size_t hash(std::string_view name) { return std::hash<std::string_view>()(name); }
+
+        // Keeps the earliest definition in input order, regardless of
+        // the order threads get here; returns false if name was taken.
+        bool insert(std::string_view, size_t, SymbolReference);
+
+        // Not synchronised; only call once all insertions are done.
+        bool find(std::string_view, size_t, SymbolReference&);
+    private:
+        static const size_t SHARD_COUNT = 64;
+
+        struct Key {
+            std::string_view name;
+            size_t hash;
+            bool operator==(const Key& other) const { return name == other.name; }
+        };
+        struct KeyHash {
+            size_t operator()(const Key& key) const { return key.hash; }
+        };
+        struct Shard {
+            std::mutex mutex;
+            std::unordered_map<Key, SymbolReference, KeyHash> symbols;
+        };
+
+        std::array<Shard, SHARD_COUNT> shards;
+};
+
+}; // namespace ldnp
+
+#endif
@@ -0,0 +1,267 @@
+#include "archive.h"
+
+#include <ar.h>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace libelf {
+
+Archive::Archive(std::string _fileName): fileName(_fileName), mapping(0), mappingSize(0) {}
+Archive::Archive(): mapping(0), mappingSize(0) {}
+Archive::~Archive() {
+    if (mapping != 0) {
+        munmap(mapping, mappingSize);
+        mapping = 0;
+    }
+}
+
+bool Archive::isArchive(std::string fileName) {
+    std::ifstream file(fileName, std::ios::in|std::ios::binary);
+    char magic[SARMAG];
+    if (!file.read(magic, SARMAG)) {
+        return false;
+    }
+    return std::memcmp(magic, ARMAG, SARMAG) == 0;
+}
+
+uint32_t readBigEndian(const char *data) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+void appendBigEndian(std::vector<char>& out, uint32_t value) {
+    out.push_back((value >> 24) & 0xff);
+    out.push_back((value >> 16) & 0xff);
+    out.push_back((value >> 8) & 0xff);
+    out.push_back(value & 0xff);
+}
+
+bool Archive::read() {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < SARMAG) {
+        close(fd);
+        return false;
+    }
+
+    void *address = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+
+    mapping = (char *) address;
+    mappingSize = status.st_size;
+
+    if (std::memcmp(mapping, ARMAG, SARMAG) != 0) {
+        return false;
+    }
+
+    std::string_view index;
+    std::string_view longNames;
+    std::vector<size_t> headerOffsets;
+
+    size_t offset = SARMAG;
+    while (offset + sizeof(ar_hdr) <= mappingSize) {
+        ar_hdr header;
+        std::memcpy(&header, mapping + offset, sizeof(header));
+        if (std::memcmp(header.ar_fmag, ARFMAG, 2) != 0) {
+            return false;
+        }
+
+        std::string sizeField(header.ar_size, sizeof(header.ar_size));
+        size_t size = std::strtoul(sizeField.c_str(), 0, 10);
+        size_t dataOffset = offset + sizeof(header);
+        if (size > mappingSize - dataOffset) {
+            return false;
+        }
+
+        std::string name(header.ar_name, sizeof(header.ar_name));
+        name.erase(name.find_last_not_of(' ') + 1);
+
+        if (name == "/") {
+            index = std::string_view(mapping + dataOffset, size);
+        }
+        else if (name == "//") {
+            longNames = std::string_view(mapping + dataOffset, size);
+        }
+        else {
+            if (name.length() > 1 && name[0] == '/') {
+                // "/123" names a string in the long name table
+                size_t start = std::strtoul(name.c_str() + 1, 0, 10);
+                if (start >= longNames.size()) {
+                    return false;
+                }
+                name = longNames.substr(start, longNames.find('/', start) - start);
+            }
+            else if (!name.empty() && name.back() == '/') {
+                name.pop_back();
+            }
+
+            ArchiveMember member;
+            member.name = name;
+            member.offset = dataOffset;
+            member.size = size;
+            members.push_back(member);
+            headerOffsets.push_back(offset);
+        }
+
+        // members are padded to an even offset
+        offset = dataOffset + size + (size & 1);
+    }
+
+    if (index.size() < 4) {
+        return true;
+    }
+
+    uint32_t symbolCount = readBigEndian(index.data());
+    if (symbolCount > (index.size() - 4) / 4) {
+        return false;
+    }
+
+    size_t name = 4 + symbolCount * 4;
+    for (uint32_t i = 0; i < symbolCount && name < index.size(); i++) {
+        size_t length = strnlen(index.data() + name, index.size() - name);
+        std::string_view symbol(index.data() + name, length);
+        name += length + 1;
+
+        size_t headerOffset = readBigEndian(index.data() + 4 + i * 4);
+        auto member = std::lower_bound(headerOffsets.begin(), headerOffsets.end(), headerOffset);
+        if (member == headerOffsets.end() || *member != headerOffset) {
+            return false;
+        }
+
+        // the first member to define a symbol wins
+        symbolIndex.try_emplace(symbol, member - headerOffsets.begin());
+    }
+
+    return true;
+}
+
+std::shared_ptr<ElfFile> Archive::getMember(size_t index) {
+    auto& member = members.at(index);
+    auto name = fileName + "(" + member.name + ")";
+
+    // the member keeps the archive, and so its mapping, alive
+    return std::make_shared<ElfFile>(name, mapping + member.offset, member.size, shared_from_this());
+}
+
+long Archive::findSymbol(std::string_view symbol) {
+    auto found = symbolIndex.find(symbol);
+    if (found == symbolIndex.end()) {
+        return -1;
+    }
+
+    return found->second;
+}
+
+void Archive::addMember(std::string name, std::vector<char> data, std::vector<std::string> symbols) {
+    ArchiveMember member;
+    member.name = name;
+    member.offset = 0;
+    member.size = data.size();
+    member.data = std::move(data);
+    member.symbols = std::move(symbols);
+
+    members.push_back(std::move(member));
+}
+
+void appendMemberHeader(std::vector<char>& out, std::string name, size_t size) {
+    char header[sizeof(ar_hdr) + 1];
+    std::snprintf(header, sizeof(header), "%-16s%-12d%-6d%-6d%-8o%-10zu" ARFMAG, name.c_str(), 0, 0, 0, 0644, size);
+    out.insert(out.end(), header, header + sizeof(ar_hdr));
+}
+
+bool Archive::write(std::string fileName) {
+    // long name table, for anything that won't fit in a header
+    std::vector<char> longNames;
+    std::vector<std::string> headerNames;
+    for (auto& member: members) {
+        if (member.name.length() < sizeof(ar_hdr::ar_name)) {
+            headerNames.push_back(member.name + "/");
+            continue;
+        }
+        headerNames.push_back("/" + std::to_string(longNames.size()));
+        longNames.insert(longNames.end(), member.name.begin(), member.name.end());
+        longNames.push_back('/');
+        longNames.push_back('\n');
+    }
+
+    size_t symbolCount = 0;
+    size_t indexSize = 4;
+    for (auto& member: members) {
+        symbolCount += member.symbols.size();
+        for (auto& symbol: member.symbols) {
+            indexSize += 4 + symbol.length() + 1;
+        }
+    }
+
+    // work out where each member header will land
+    size_t offset = SARMAG + sizeof(ar_hdr) + indexSize + (indexSize & 1);
+    if (longNames.size() > 0) {
+        offset += sizeof(ar_hdr) + longNames.size() + (longNames.size() & 1);
+    }
+    std::vector<size_t> headerOffsets;
+    for (auto& member: members) {
+        headerOffsets.push_back(offset);
+        offset += sizeof(ar_hdr) + member.data.size() + (member.data.size() & 1);
+    }
+
+    std::vector<char> out;
+    out.reserve(offset);
+    out.insert(out.end(), ARMAG, ARMAG + SARMAG);
+
+    appendMemberHeader(out, "/", indexSize);
+    appendBigEndian(out, symbolCount);
+    for (size_t i = 0; i < members.size(); i++) {
+        for (size_t s = 0; s < members[i].symbols.size(); s++) {
+            appendBigEndian(out, headerOffsets[i]);
+        }
+    }
+    for (auto& member: members) {
+        for (auto& symbol: member.symbols) {
+            out.insert(out.end(), symbol.c_str(), symbol.c_str() + symbol.length() + 1);
+        }
+    }
+    if (indexSize & 1) {
+        out.push_back('\n');
+    }
+
+    if (longNames.size() > 0) {
+        appendMemberHeader(out, "//", longNames.size());
+        out.insert(out.end(), longNames.begin(), longNames.end());
+        if (longNames.size() & 1) {
+            out.push_back('\n');
+        }
+    }
+
+    for (size_t i = 0; i < members.size(); i++) {
+        appendMemberHeader(out, headerNames[i], members[i].data.size());
+        out.insert(out.end(), members[i].data.begin(), members[i].data.end());
+        if (members[i].data.size() & 1) {
+            out.push_back('\n');
+        }
+    }
+
+    std::ofstream file(fileName, std::ios::out|std::ios::binary|std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.write(out.data(), out.size());
+    file.close();
+
+    return !file.fail();
+}
+
+}; // namespace libelf
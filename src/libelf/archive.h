@@ -0,0 +1,56 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+
+#include "elf.h"
+
+namespace libelf {
+
+struct ArchiveMember {
+    std::string name;
+    Elf32_Off offset;   // of the member's data within the archive
+    Elf32_Word size;
+
+    std::vector<char> data;             // only when building
+    std::vector<std::string> symbols;   // only when building
+};
+
+// A System V / GNU style 'ar' archive with a symbol index. Reading maps
+// the archive and parses only the member headers and the index; members
+// are opened individually, on demand.
+class Archive : public std::enable_shared_from_this<Archive> {
+    public:
+        Archive(std::string);
+        Archive();
+        Archive(const Archive&) = delete;
+        ~Archive();
+
+        static bool isArchive(std::string);
+
+        bool read();
+        std::shared_ptr<ElfFile> getMember(size_t);
+        // member index defining the symbol, or -1
+        long findSymbol(std::string_view);
+
+        void addMember(std::string, std::vector<char>, std::vector<std::string>);
+        bool write(std::string);
+
+        std::string getFileName() { return fileName; }
+        std::vector<ArchiveMember> members;
+    private:
+        std::string fileName;
+
+        char *mapping;
+        size_t mappingSize;
+
+        std::unordered_map<std::string_view, size_t> symbolIndex;
+};
+
+}; // namespace libelf
+
+#endif
@@ -1,8 +1,16 @@
 #include "elf.h"
 
 #include <iostream>
-#include <fstream>
 #include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
 
 namespace libelf {
 
@@ -16,60 +24,187 @@ void ensureAlignment(uint32_t& value, uint32_t alignment) {
     }
 }
 
-Section::Section(): data(0), fileAlignment(0), header({}) {}
+Section::Section(): data(0), ownsData(true), fileAlignment(0), header({}) {}
 Section::~Section() {
-    if (data != 0) {
+    if (data != 0 && ownsData) {
         delete[] data;
-        data = 0;
     }
+    data = 0;
+}
+
+char *Section::modifiableData() {
+    // mapped sections are read-only; take a private copy on first write
+    if (data != 0 && !ownsData) {
+        char *copy = new char[header.sh_size];
+        std::memcpy(copy, data, header.sh_size);
+        data = copy;
+        ownsData = true;
+    }
+
+    return data;
+}
+
+void Section::borrowData(char *buffer, Elf32_Word size) {
+    // the caller keeps ownership and must outlive this section
+    if (data != 0 && ownsData) {
+        delete[] data;
+    }
+
+    data = buffer;
+    ownsData = false;
+    header.sh_size = size;
+}
+
+void Section::takeData(char *buffer, Elf32_Word size) {
+    // buffer must come from new[]; the section deletes it
+    if (data != 0 && ownsData) {
+        delete[] data;
+    }
+
+    data = buffer;
+    ownsData = true;
+    header.sh_size = size;
+}
+
+std::string_view StringArena::add(std::string_view string) {
+    size_t length = string.length() + 1;
+    if (used + length > capacity) {
+        capacity = std::max(BLOCK_SIZE, length);
+        blocks.push_back(std::make_unique<char[]>(capacity));
+        used = 0;
+    }
+
+    char *start = blocks.back().get() + used;
+    std::memcpy(start, string.data(), string.length());
+    start[string.length()] = 0;
+    used += length;
+
+    return std::string_view(start, string.length());
 }
 
-bool Section::addSymbol(std::shared_ptr<Section> section, std::string name, Elf32_Word offset) {
+void StringTableBuilder::add(std::string_view string) {
+    if (offsets.contains(string)) {
+        return;
+    }
+
+    offsets[string] = 0;
+    strings.push_back(string);
+}
+
+void StringTableBuilder::build() {
+    // longest first, so every tail is already in the table when its
+    // shorter string comes up
+    std::stable_sort(strings.begin(), strings.end(), [](std::string_view a, std::string_view b) {
+        return a.length() > b.length();
+    });
+
+    size_t capacity = 1;
+    for (auto string: strings) {
+        capacity += string.length() + 1;
+    }
+    // reserved up front so the suffix views below stay valid
+    table.clear();
+    table.reserve(capacity);
+    table.push_back(0);
+
+    std::unordered_map<SuffixKey, Elf32_Word, SuffixHash> suffixes;
+    suffixes.reserve(capacity);
+
+    std::vector<size_t> hashes;
+    for (auto string: strings) {
+        if (string.empty()) {
+            offsets[string] = 0;
+            continue;
+        }
+
+        // hash every suffix of the string, back to front, in one pass
+        hashes.resize(string.length());
+        size_t hash = 0;
+        for (size_t i = string.length(); i-- > 0; ) {
+            hash = hash * 131 + (uint8_t) string[i];
+            hashes[i] = hash;
+        }
+
+        auto found = suffixes.find({string, hashes[0]});
+        if (found != suffixes.end()) {
+            offsets[string] = found->second;
+            continue;
+        }
+
+        Elf32_Word offset = table.size();
+        offsets[string] = offset;
+        table.insert(table.end(), string.begin(), string.end());
+        table.push_back(0);
+
+        const char *stored = table.data() + offset;
+        for (size_t i = 0; i < string.length(); i++) {
+            suffixes.try_emplace({std::string_view(stored + i, string.length() - i), hashes[i]}, offset + i);
+        }
+    }
+}
+
+Elf32_Word StringTableBuilder::getOffset(std::string_view string) {
+    auto found = offsets.find(string);
+    if (found == offsets.end()) {
+        return 0;
+    }
+
+    return found->second;
+}
+
+bool Section::addSymbol(std::shared_ptr<Section> section, std::string_view name, Elf32_Word offset, unsigned char binding) {
     if (!isSymbolTable()) {
         return false;
     }
 
-    if (symbolMap.size() == 0) {
-        auto nullSymbol = std::make_shared<Symbol>();
-        nullSymbol->index = 0;
-        symbols.push_back(nullSymbol);
+    if (symbols.size() == 0) {
+        symbols.emplace_back();
     }
 
     if (symbolMap.contains(name)) {
         return false;
     }
 
+    // sh_info is the index of the first non-local symbol
+    if (binding == STB_LOCAL) {
+        if (header.sh_info != symbols.size()) {
+            return false;
+        }
+        header.sh_info++;
+    }
 
-    auto symbol = std::make_shared<Symbol>();
-    symbol->name = name;
-    symbol->header.st_value = offset;
-    symbol->header.st_info = ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE);
-    symbol->header.st_shndx = section ? section->index : SHN_UNDEF;
-    symbol->section = section;
-    symbol->index = symbols.size();
+    Symbol symbol;
+    symbol.name = strings.add(name);
+    symbol.header.st_value = offset;
+    symbol.header.st_info = ELF32_ST_INFO(binding, STT_NOTYPE);
+    symbol.header.st_shndx = section ? section->index : SHN_UNDEF;
 
+    symbolMap[symbol.name] = symbols.size();
     symbols.push_back(symbol);
-    symbolMap[name] = symbol;
 
     return true;
 }
 
-bool Section::addRelocation(std::shared_ptr<Section> section, std::shared_ptr<Symbol> symbol, Elf32_Word offset, uint8_t type) {
+Elf32_Word Section::findSymbol(std::string_view name) {
+    auto found = symbolMap.find(name);
+    if (found == symbolMap.end()) {
+        return STN_UNDEF;
+    }
+
+    return found->second;
+}
+
+bool Section::addRelocation(Elf32_Word symbol, Elf32_Word offset, uint8_t type) {
     if (!isRelocationTable()) {
         return false;
     }
 
-    auto relocation = std::make_shared<Relocation>();
-    relocation->symbol = symbol;
-    relocation->offset = offset;
-    relocation->type = type;
-    relocation->section = section;
-    relocations.push_back(relocation);
+    relocations.push_back({offset, symbol, type});
 
     return true;
 }
 
-std::string Section::getString(Elf32_Word offset) {
+std::string_view Section::getString(Elf32_Word offset) {
     if (!isStringTable() || data == 0) {
         return "";
     }
@@ -78,19 +213,8 @@ std::string Section::getString(Elf32_Word offset) {
         return "";
     }
 
-    return (char *) (data + offset);
-}
-
-std::shared_ptr<Symbol> Section::getSymbol(Elf32_Word offset) {
-    std::shared_ptr<Symbol> symbol;
-    if (!isSymbolTable() || data == 0) {
-        return symbol;
-    }
-    if (offset >= symbols.size()) {
-        return symbol;
-    }
-
-    return symbols[offset];
+    // don't run off the end of an unterminated table
+    return std::string_view(data + offset, strnlen(data + offset, header.sh_size - offset));
 }
 
 bool Section::extractData(ElfFile& file) {
@@ -100,20 +224,23 @@ bool Section::extractData(ElfFile& file) {
 
     if (isRelocationTable()) {
         auto symbolTable = file.getSection(header.sh_link);
-        auto referenceSection = file.getSection(header.sh_info);
+        Elf32_Word symbolCount = symbolTable->header.sh_size / sizeof(Elf32_Sym);
 
         int relocationCount = header.sh_size / sizeof(Elf32_Rel);
         relocations.reserve(relocationCount);
 
         for (int i = 0; i < relocationCount; i++) {
-            auto relocation = std::make_shared<Relocation>();
-            Elf32_Rel header = ((Elf32_Rel *)data)[i];
-
-            relocation->symbol = symbolTable->getSymbol(header.r_info >> 8);
-            relocation->type = (uint8_t) header.r_info & 0xff;
-            relocation->offset = header.r_offset;
-            relocation->section = referenceSection;
-            
+            Elf32_Rel header;
+            std::memcpy(&header, data + i * sizeof(Elf32_Rel), sizeof(Elf32_Rel));
+
+            Relocation relocation;
+            relocation.symbol = header.r_info >> 8;
+            relocation.type = (uint8_t) header.r_info & 0xff;
+            relocation.offset = header.r_offset;
+            if (relocation.symbol >= symbolCount) {
+                return false;
+            }
+
             relocations.push_back(relocation);
         }
     }
@@ -121,22 +248,31 @@ bool Section::extractData(ElfFile& file) {
         auto symbolNames = file.getSection(header.sh_link);
 
         int symbolCount = header.sh_size / sizeof(Elf32_Sym);
-        symbols.reserve(symbolCount);
+        symbols.resize(symbolCount);
+        symbolMap.reserve(symbolCount);
 
         for (int i = 0; i < symbolCount; i++) {
-            auto symbol = std::make_shared<Symbol>();
-            symbol->header = ((Elf32_Sym *)data)[i];
+            auto& symbol = symbols[i];
+            std::memcpy(&symbol.header, data + i * sizeof(Elf32_Sym), sizeof(Elf32_Sym));
 
-            symbol->name = symbolNames->getString(symbol->header.st_name);
-            symbol->index = symbol->header.st_value;
-            if (symbol->header.st_shndx != SHN_UNDEF) {
-                symbol->section = file.getSection(symbol->header.st_shndx);
+            symbol.name = symbolNames->getString(symbol.header.st_name);
+            if (symbol.isDefined() && symbol.header.st_shndx >= file.sectionCount()) {
+                return false;
             }
 
-            symbols.push_back(symbol);
-            symbolMap[symbol->name] = symbol;
+            symbolMap[symbol.name] = i;
         }
     }
+    else if (header.sh_type == SHT_NP_RELTYPES) {
+        int typeCount = header.sh_size / sizeof(RelocationType);
+        relocationTypes.resize(typeCount);
+        std::memcpy(relocationTypes.data(), data, typeCount * sizeof(RelocationType));
+    }
+    else if (header.sh_type == SHT_NP_RELAX) {
+        int ruleCount = header.sh_size / sizeof(RelaxationRule);
+        relaxationRules.resize(ruleCount);
+        std::memcpy(relaxationRules.data(), data, ruleCount * sizeof(RelaxationRule));
+    }
 
     return true;
 }
@@ -155,10 +291,10 @@ bool Section::generateData() {
         data = new char[header.sh_size];
 
         for (int i = 0; i < relocations.size(); i++) {
-            auto relocation = relocations[i];
-            Elf32_Word r_info = relocation->symbol->index << 8 | relocation->type;
+            auto& relocation = relocations[i];
+            Elf32_Word r_info = relocation.symbol << 8 | relocation.type;
             Elf32_Rel rel = {
-                relocation->offset,
+                relocation.offset,
                 r_info
             };
             ((Elf32_Rel *) data)[i] = rel;
@@ -173,20 +309,32 @@ bool Section::generateData() {
         data = new char[header.sh_size];
 
         for (int i = 0; i < symbols.size(); i++) {
-            auto symbol = symbols[i];
-
-            ((Elf32_Sym *) data)[i] = symbol->header;
+            ((Elf32_Sym *) data)[i] = symbols[i].header;
         }
     }
+    else if (header.sh_type == SHT_NP_RELTYPES) {
+        header.sh_size = relocationTypes.size() * sizeof(RelocationType);
+        header.sh_entsize = sizeof(RelocationType);
+
+        data = new char[header.sh_size];
+        std::memcpy(data, relocationTypes.data(), header.sh_size);
+    }
+    else if (header.sh_type == SHT_NP_RELAX) {
+        header.sh_size = relaxationRules.size() * sizeof(RelaxationRule);
+        header.sh_entsize = sizeof(RelaxationRule);
+
+        data = new char[header.sh_size];
+        std::memcpy(data, relaxationRules.data(), header.sh_size);
+    }
 
     return true;
 }
 
-Elf32_Word Symbol::address() {
-    if (section) {
-        return section->header.sh_addr + header.st_value;
+Elf32_Word ElfFile::symbolAddress(const Symbol& symbol) {
+    if (symbol.header.st_shndx != SHN_UNDEF && symbol.header.st_shndx < sections.size()) {
+        return sections[symbol.header.st_shndx]->header.sh_addr + symbol.header.st_value;
     }
-    return header.st_value;
+    return symbol.header.st_value;
 }
 
 
@@ -198,8 +346,10 @@ uint8_t identBytes[8] = {
     ELFOSABI_STANDALONE
 };
 
-ElfFile::ElfFile(std::string _fileName): fileName(_fileName) {}
-ElfFile::ElfFile(Elf32_Half type):header({}) {
+ElfFile::ElfFile(std::string _fileName): fileName(_fileName), mapping(0), mappingSize(0), indexed(false) {}
+ElfFile::ElfFile(std::string _fileName, char *buffer, size_t size, std::shared_ptr<void> owner):
+    fileName(_fileName), mapping(buffer), mappingSize(size), mappingOwner(owner), indexed(false) {}
+ElfFile::ElfFile(Elf32_Half type): mapping(0), mappingSize(0), header({}), indexed(false) {
     for (int i = 0; i < 8; i++) {
         header.e_ident[i] = identBytes[i];
     }
@@ -211,6 +361,12 @@ ElfFile::ElfFile(Elf32_Half type):header({}) {
     header.e_phentsize = sizeof(Elf32_Phdr);
     header.e_shentsize = sizeof(Elf32_Shdr);
 }
+ElfFile::~ElfFile() {
+    if (mapping != 0 && !mappingOwner) {
+        munmap(mapping, mappingSize);
+        mapping = 0;
+    }
+}
 
 
 std::shared_ptr<Section> ElfFile::addSection(Elf32_Word type, std::shared_ptr<Section> link, std::shared_ptr<Section> info) {
@@ -239,6 +395,7 @@ std::shared_ptr<Section> ElfFile::addSection(Elf32_Word type, std::shared_ptr<Se
 
     section->index = sections.size();
     sections.push_back(section);
+    indexed = false;
 
     return section;
 }
@@ -252,27 +409,70 @@ std::shared_ptr<Segment> ElfFile::addSegment(Elf32_Word type) {
     return segment;
 }
 
+bool ElfFile::mapFile() {
+    if (mapping != 0) {
+        return true;
+    }
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(Elf32_Ehdr)) {
+        close(fd);
+        return false;
+    }
+
+    void *address = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+
+    mapping = (char *) address;
+    mappingSize = status.st_size;
+
+    return true;
+}
+
+bool ElfFile::inBounds(Elf32_Off offset, Elf32_Word size) {
+    return offset <= mappingSize && size <= mappingSize - offset;
+}
+
 bool ElfFile::readHeaders() {
-    std::ifstream file(fileName, std::ios::in|std::ios::binary/*|std::ios::ate*/);
-    if (!file.is_open()) {
+    if (!mapFile()) {
         return false;
     }
 
-    file.read((char *)&header, sizeof(header));
+    if (mappingSize < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, mapping, sizeof(header));
     if (!acceptable(ET_NONE)) {
         return false;
     }
 
+    // make sure both header tables lie inside the file (the counts and
+    // sizes are 16 bits, so their product needs more than an int)
+    if (!inBounds(header.e_phoff, (Elf32_Word) header.e_phnum * header.e_phentsize)) {
+        return false;
+    }
+    if (!inBounds(header.e_shoff, (Elf32_Word) header.e_shnum * header.e_shentsize)) {
+        return false;
+    }
+
     // preallocate space for program headers
     segments.reserve(header.e_phnum);
 
-    // go to the start of the program header table
-    file.seekg(header.e_phoff);
     // read each program header
     for (int i = 0; i < header.e_phnum; i++) {
         auto segment = std::make_shared<Segment>();
 
-        file.read((char *)&(segment->header), header.e_phentsize);
+        auto entry = mapping + header.e_phoff + (Elf32_Word) i * header.e_phentsize;
+        std::memcpy(&(segment->header), entry, std::min<size_t>(header.e_phentsize, sizeof(Elf32_Phdr)));
 
         segments.push_back(segment);
     }
@@ -282,13 +482,19 @@ bool ElfFile::readHeaders() {
 
     std::shared_ptr<Section> sectionNames;
 
-    // go to the start of the section header table
-    file.seekg(header.e_shoff);
     // read each section header
     for (int i = 0; i < header.e_shnum; i++) {
         std::shared_ptr<Section> section = std::make_shared<Section>();
 
-        file.read((char *)&(section->header), header.e_shentsize);
+        auto entry = mapping + header.e_shoff + (Elf32_Word) i * header.e_shentsize;
+        std::memcpy(&(section->header), entry, std::min<size_t>(header.e_shentsize, sizeof(Elf32_Shdr)));
+        section->index = i;
+
+        // every section with file contents must fit in the file
+        if (section->header.sh_type != SHT_NOBITS && section->header.sh_type != SHT_NULL &&
+                !inBounds(section->header.sh_offset, section->header.sh_size)) {
+            return false;
+        }
 
         // keep a copy of the section name strings for later
         if (i == header.e_shstrndx) {
@@ -303,16 +509,13 @@ bool ElfFile::readHeaders() {
         return false;
     }
 
-    // allocate string space
-    sectionNames->data = new char[sectionNames->header.sh_size];
-    // go to start of strings
-    file.seekg(sectionNames->header.sh_offset);
-    // read section name strings
-    file.read(sectionNames->data, sectionNames->header.sh_size);
+    // point at the section name strings in place
+    sectionNames->data = mapping + sectionNames->header.sh_offset;
+    sectionNames->ownsData = false;
 
     // resolve names
     for (auto section: sections) {
-        section->name = (char *) (sectionNames->data + section->header.sh_name);
+        section->name = sectionNames->getString(section->header.sh_name);
     }
 
     return true;
@@ -334,9 +537,19 @@ bool ElfFile::readProgBits() {
     return readSectionsOfType(SHT_PROGBITS);
 }
 
+bool ElfFile::readRelocationTypes() {
+    return readSectionsOfType(SHT_NP_RELTYPES);
+}
+
+bool ElfFile::readRelaxationRules() {
+    return readSectionsOfType(SHT_NP_RELAX);
+}
+
 bool ElfFile::readSectionsOfType(Elf32_Word type) {
-    std::ifstream file(fileName, std::ios::in|std::ios::binary/*|std::ios::ate*/);
-    
+    if (mapping == 0) {
+        return false;
+    }
+
     for (auto section: sections) {
         if (section->header.sh_type != type) {
             continue;
@@ -344,13 +557,14 @@ bool ElfFile::readSectionsOfType(Elf32_Word type) {
         if (section->data != 0) {
             continue;
         }
-    
-        section->data = new char[section->header.sh_size];
 
-        file.seekg(section->header.sh_offset);
-        file.read(section->data, section->header.sh_size);
+        // sections are views into the mapping; see Section::modifiableData()
+        section->data = mapping + section->header.sh_offset;
+        section->ownsData = false;
 
-        section->extractData(*this);
+        if (!section->extractData(*this)) {
+            return false;
+        }
     }
 
     return true;
@@ -362,19 +576,19 @@ bool ElfFile::generateSymbolStrings(std::shared_ptr<Section> section) {
     auto strings = addSection(SHT_STRTAB, nullSection, nullSection);
     section->link = strings;
     strings->name = ".strtab";
-    int tableLength = 0;
-    for (auto symbol: section->symbols) {
-        tableLength += symbol->name.length() + 1;
+
+    StringTableBuilder builder;
+    for (auto& symbol: section->symbols) {
+        builder.add(symbol.name);
     }
-    strings->data = new char[tableLength];
-    strings->header.sh_size = tableLength;
+    builder.build();
+
+    strings->data = new char[builder.size()];
+    strings->header.sh_size = builder.size();
+    std::memcpy(strings->data, builder.data(), builder.size());
 
-    int index = 0;
-    for (auto symbol: section->symbols) {
-        symbol->header.st_name = index;
-        int length = symbol->name.length() + 1;
-        std::strcpy(strings->data + index, symbol->name.c_str());
-        index += length;
+    for (auto& symbol: section->symbols) {
+        symbol.header.st_name = builder.getOffset(symbol.name);
     }
 
     return true;
@@ -386,19 +600,18 @@ bool ElfFile::generateSectionNameStrings() {
     strings->name = ".shstrtab";
     header.e_shstrndx = strings->index;
 
-    int tableLength = 0;
+    StringTableBuilder builder;
     for (auto section: sections) {
-        tableLength += section->name.length() + 1;
+        builder.add(section->name);
     }
-    strings->data = new char[tableLength];
-    strings->header.sh_size = tableLength;
+    builder.build();
+
+    strings->data = new char[builder.size()];
+    strings->header.sh_size = builder.size();
+    std::memcpy(strings->data, builder.data(), builder.size());
 
-    int index = 0;
     for (auto section: sections) {
-        section->header.sh_name = index;
-        int length = section->name.length() + 1;
-        std::strcpy(strings->data + index, section->name.c_str());
-        index += length;
+        section->header.sh_name = builder.getOffset(section->name);
     }
 
     return true;
@@ -412,6 +625,56 @@ bool ElfFile::generateSectionData() {
     return true;
 }
 
+// A contiguous run of output bytes at a fixed file offset. Anything not
+// covered by a chunk (alignment padding) is left as a hole, which reads
+// back as zeroes.
+struct OutputChunk {
+    Elf32_Off offset;
+    const char *data;
+    size_t size;
+};
+
+bool writeChunks(int fd, std::vector<OutputChunk>& chunks) {
+    size_t next = 0;
+    while (next < chunks.size()) {
+        // gather chunks that sit back to back into a single call
+        std::vector<struct iovec> run;
+        off_t start = chunks[next].offset;
+        off_t end = start;
+        while (next < chunks.size() && chunks[next].offset == end && run.size() < IOV_MAX) {
+            run.push_back({(void *) chunks[next].data, chunks[next].size});
+            end += chunks[next].size;
+            next++;
+        }
+
+        struct iovec *pending = run.data();
+        int pendingCount = run.size();
+        while (pendingCount > 0) {
+            ssize_t written = pwritev(fd, pending, pendingCount, start);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            start += written;
+
+            // skip past whatever was fully written; trim a partial chunk
+            while (pendingCount > 0 && (size_t) written >= pending->iov_len) {
+                written -= pending->iov_len;
+                pending++;
+                pendingCount--;
+            }
+            if (pendingCount > 0) {
+                pending->iov_base = (char *) pending->iov_base + written;
+                pending->iov_len -= written;
+            }
+        }
+    }
+
+    return true;
+}
+
 bool ElfFile::write(std::string fileName) {
     /*
      *  For our use-case here:
@@ -419,36 +682,21 @@ bool ElfFile::write(std::string fileName) {
      *  2. section data follows program headers
      *  3. section headers follow section data
      *  4. no data byte is outside a section
+     *
+     *  The whole layout is worked out before anything is written, so the
+     *  file can be sized once and filled with a handful of pwritev calls.
      */
 
-    std::ofstream file(fileName);
-
-    // Write provisional header
-    // (we'll rewrite it later with correct offsets)
-    file.write((char *)&header, sizeof(header));
-    Elf32_Word offset = sizeof(header);
-
-    // Write segment headers
-    for (auto segment: segments) {
-        file.write((char *)&segment->header, sizeof(segment->header));
-        offset += sizeof(segment->header);
-    }
-
-    std::shared_ptr<Section> previousSection;
+    std::vector<OutputChunk> chunks;
+    Elf32_Word offset = sizeof(header) + segments.size() * sizeof(Elf32_Phdr);
 
-    // Write section data (which is also segment data, if any)
+    // Lay out section data (which is also segment data, if any)
     for (auto section: sections) {
-        if (section->isNoBits() || section->isNull() || section->isProc()) {
+        // processor sections only take up space if they carry data
+        if (section->isNoBits() || section->isNull() || (section->isProc() && section->header.sh_size == 0)) {
             continue;
         }
-        auto misalignment = offset;
         ensureAlignment(offset, section->fileAlignment);
-        if (misalignment != offset) {
-            while (misalignment != offset) {
-                file.put(0);
-                misalignment++;
-            }
-        }
         section->header.sh_offset = offset;
 
         if (section->componentSections.size() > 0) {
@@ -458,16 +706,11 @@ bool ElfFile::write(std::string fileName) {
                 if (!component->isProgBits()) {
                     continue;
                 }
-                misalignment = offset;
                 ensureAlignment(offset, component->header.sh_addralign);
-                if (offset != misalignment) {
-                    while (offset != misalignment) {
-                        file.put(0);
-                        misalignment++;
-                    }
-                }
 
-                file.write(component->data, component->header.sh_size);
+                if (component->data != 0 && component->header.sh_size > 0) {
+                    chunks.push_back({offset, component->data, component->header.sh_size});
+                }
                 offset += component->header.sh_size;
                 // we've already calculated this size, so we don't
                 // want to double up on it
@@ -475,15 +718,11 @@ bool ElfFile::write(std::string fileName) {
             }
         }
         else {
-            auto misalignment = offset;
             ensureAlignment(offset, section->header.sh_addralign);
-            if (offset != misalignment) {
-                while (offset != misalignment) {
-                    file.put(0);
-                    misalignment++;
-                }
+            section->header.sh_offset = offset;
+            if (section->data != 0 && section->header.sh_size > 0) {
+                chunks.push_back({offset, section->data, section->header.sh_size});
             }
-            file.write(section->data, section->header.sh_size);
             offset += section->header.sh_size;
         }
     }
@@ -499,38 +738,74 @@ bool ElfFile::write(std::string fileName) {
         header.e_phoff = sizeof(header);
     }
 
-    // Write section headers
+    std::vector<Elf32_Phdr> programHeaders;
+    programHeaders.reserve(segments.size());
+    for (auto segment: segments) {
+        programHeaders.push_back(segment->header);
+    }
+
+    std::vector<Elf32_Shdr> sectionHeaders;
+    sectionHeaders.reserve(sections.size());
     for (auto section: sections) {
-        file.write((char *)&(section->header), sizeof(section->header));
+        sectionHeaders.push_back(section->header);
     }
 
-    file.seekp(0);
-    // Rewrite file header
-    file.write((char *)&header, sizeof(header));
-    // Rewrite program segment headers
-    for (auto segment: segments) {
-        file.write((char *)&segment->header, header.e_phentsize);
+    Elf32_Word fileSize = offset + sectionHeaders.size() * sizeof(Elf32_Shdr);
+
+    chunks.insert(chunks.begin(), {
+        {0, (char *) &header, sizeof(header)},
+        {sizeof(header), (char *) programHeaders.data(), programHeaders.size() * sizeof(Elf32_Phdr)}
+    });
+    chunks.push_back({offset, (char *) sectionHeaders.data(), sectionHeaders.size() * sizeof(Elf32_Shdr)});
+
+    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return false;
     }
 
+    bool success = ftruncate(fd, fileSize) == 0 && writeChunks(fd, chunks);
+
     // Done!
-    file.close();
+    if (close(fd) != 0) {
+        success = false;
+    }
 
-    return true;
+    return success;
 }
 
 std::shared_ptr<Section> ElfFile::getSection(int index) {
     return sections.at(index);
 }
 
-std::shared_ptr<Section> ElfFile::findSection(Elf32_Word type, std::string name) {
+void ElfFile::indexSections() {
+    sectionsByName.clear();
+    sectionsByType.clear();
+
     for (auto section: sections) {
-        if (type != SHT_NULL && type != section->header.sh_type) {
-            continue;
+        sectionsByName[section->name].push_back(section);
+        sectionsByType[section->header.sh_type].push_back(section);
+    }
+
+    indexed = true;
+}
+
+std::shared_ptr<Section> ElfFile::findSection(Elf32_Word type, std::string name) {
+    if (!indexed) {
+        indexSections();
+    }
+
+    if (name.empty()) {
+        auto& candidates = findSections(type);
+        if (candidates.size() > 0) {
+            return candidates[0];
         }
-        if (!name.empty() && name != section->name) {
-            continue;
+    }
+    else if (sectionsByName.contains(name)) {
+        for (auto section: sectionsByName[name]) {
+            if (type == SHT_NULL || type == section->header.sh_type) {
+                return section;
+            }
         }
-        return section;
     }
 
     throw std::out_of_range("ElfFile::findSection");
@@ -539,18 +814,22 @@ std::shared_ptr<Section> ElfFile::findSection(std::string name) {
     return findSection(SHT_NULL, name);
 }
 
-std::vector<std::shared_ptr<Section>> ElfFile::findSections(Elf32_Word type) {
+const std::vector<std::shared_ptr<Section>>& ElfFile::findSections(Elf32_Word type) {
     if (type == SHT_NULL) {
         return sections;
     }
-    std::vector<std::shared_ptr<Section>> filteredSections;
-    for (auto section: sections) {
-        if (section->header.sh_type == type) {
-            filteredSections.push_back(section);
-        }
+    if (!indexed) {
+        indexSections();
+    }
+
+    static const std::vector<std::shared_ptr<Section>> noSections;
+
+    auto found = sectionsByType.find(type);
+    if (found == sectionsByType.end()) {
+        return noSections;
     }
 
-    return filteredSections;
+    return found->second;
 }
 
 bool ElfFile::acceptable(Elf32_Half type) {
@@ -3,8 +3,9 @@
 
 #include <elf.h>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
+#include <unordered_map>
 #include <memory>
 
 namespace libelf {
@@ -15,25 +16,106 @@ namespace libelf {
 #define N16R_REL_B2     6
 #define N16R_REL_B3     7
 
+// processor-specific section listing how each relocation type is applied
+#define SHT_NP_RELTYPES (SHT_LOPROC + 1)
+
+#define RELTYPE_PCREL   1
+
+// processor-specific section listing code the linker may drop once
+// relocated values are known
+#define SHT_NP_RELAX    (SHT_LOPROC + 2)
+
+#define RELAX_IF_ZERO   1
+
+// sections the linker must keep even when nothing refers to them
+#ifndef SHF_GNU_RETAIN
+#define SHF_GNU_RETAIN  (1 << 21)
+#endif
+
+// sections padded inside to a boundary or an .org point, so their length
+// before the padding must not change
+#define SHF_NP_ALIGNED  0x10000000
+
 struct Section;
 struct ElfFile;
 
+// Append-only string storage. Strings never move once added, so views
+// handed out stay valid for the lifetime of the arena.
+class StringArena {
+    public:
+        StringArena(): used(0), capacity(0) {}
+
+        std::string_view add(std::string_view);
+    private:
+        static constexpr size_t BLOCK_SIZE = 16384;
+
+        std::vector<std::unique_ptr<char[]>> blocks;
+        size_t used;
+        size_t capacity;
+};
+
+// Lays out a string table. Identical strings are stored once, and a
+// string that is the tail of a longer one (".text" in ".rel.text") points
+// into it instead of being stored separately.
+class StringTableBuilder {
+    public:
+        void add(std::string_view);
+        void build();
+
+        Elf32_Word getOffset(std::string_view);
+        Elf32_Word size() { return table.size(); }
+        const char *data() { return table.data(); }
+    private:
+        struct SuffixKey {
+            std::string_view string;
+            size_t hash;
+            bool operator==(const SuffixKey& other) const { return string == other.string; }
+        };
+        struct SuffixHash {
+            size_t operator()(const SuffixKey& key) const { return key.hash; }
+        };
+
+        std::vector<std::string_view> strings;
+        std::unordered_map<std::string_view, Elf32_Word> offsets;
+        std::vector<char> table;
+};
+
+// One entry of an SHT_NP_RELTYPES section. The value written is
+// ((S [- P]) >> shift) & mask, stored most significant bit first in a
+// field of width bits that starts bit bits into the relocated byte.
+struct RelocationType {
+    Elf32_Word type;
+    Elf32_Word mask;    // 0 keeps the low width bits
+    uint8_t shift;
+    uint8_t width;
+    uint8_t bit;
+    uint8_t flags;
+};
+
+// One entry of an SHT_NP_RELAX section: when a relocation of this type
+// comes out to a value meeting the condition, the size bytes starting
+// start bytes from the relocated offset can be deleted.
+struct RelaxationRule {
+    uint8_t type;
+    int8_t start;
+    uint8_t size;
+    uint8_t condition;
+};
+
 struct Symbol {
     Symbol(): header({}) {}
     Elf32_Sym header;
 
-    Elf32_Word address();
+    // points into the string table or the owning section's arena
+    std::string_view name;
 
-    std::string name;
-    std::shared_ptr<Section> section;
-    Elf32_Word index;
+    bool isDefined() { return header.st_shndx != SHN_UNDEF && header.st_shndx < SHN_LORESERVE; }
+    bool isLocal() { return ELF32_ST_BIND(header.st_info) == STB_LOCAL; }
 };
 struct Relocation {
-    std::shared_ptr<Symbol> symbol;
     Elf32_Word offset;
+    Elf32_Word symbol;  // index into the linked symbol table
     uint8_t type;
-
-    std::shared_ptr<Section> section;
 };
 struct Section {
     Section();
@@ -58,19 +140,29 @@ struct Section {
     bool extractData(ElfFile&);
     bool generateData();
 
-    bool addRelocation(std::shared_ptr<Section>, std::shared_ptr<Symbol>, Elf32_Word, uint8_t);
-    bool addSymbol(std::shared_ptr<Section>, std::string, Elf32_Word);
+    bool addRelocation(Elf32_Word, Elf32_Word, uint8_t);
+    // local symbols must all be added before any global one
+    bool addSymbol(std::shared_ptr<Section>, std::string_view, Elf32_Word, unsigned char binding = STB_GLOBAL);
+    Elf32_Word findSymbol(std::string_view);
 
-    std::string getString(Elf32_Word);
-    std::shared_ptr<Symbol> getSymbol(Elf32_Word);
+    std::string_view getString(Elf32_Word);
+
+    char *modifiableData();
+    void borrowData(char *, Elf32_Word);
+    void takeData(char *, Elf32_Word);
 
     char *data;
+    // false when data is a view into a mapped input file
+    bool ownsData;
 
     std::shared_ptr<Section> link;
 
-    std::map<std::string, std::shared_ptr<Symbol>> symbolMap;
-    std::vector<std::shared_ptr<Symbol>> symbols;
-    std::vector<std::shared_ptr<Relocation>> relocations;
+    std::unordered_map<std::string_view, Elf32_Word> symbolMap;
+    std::vector<Symbol> symbols;
+    std::vector<Relocation> relocations;
+    std::vector<RelocationType> relocationTypes;
+    std::vector<RelaxationRule> relaxationRules;
+    StringArena strings;
 
     std::vector<std::shared_ptr<Section>> componentSections;
 };
@@ -82,16 +174,22 @@ struct Segment {
 struct ElfFile {
     public:
         ElfFile(std::string);
+        ElfFile(std::string, char *, size_t, std::shared_ptr<void>);
         ElfFile(Elf32_Half);
+        ElfFile(const ElfFile&) = delete;
+        ~ElfFile();
 
         bool acceptable(Elf32_Half);
 
         std::shared_ptr<Section> getSection(int);
+        Elf32_Word sectionCount() { return sections.size(); }
 
         std::shared_ptr<Section> findSection(Elf32_Word, std::string = "");
         std::shared_ptr<Section> findSection(std::string);
 
-        std::vector<std::shared_ptr<Section>> findSections(Elf32_Word);
+        const std::vector<std::shared_ptr<Section>>& findSections(Elf32_Word);
+
+        Elf32_Word symbolAddress(const Symbol&);
 
         std::shared_ptr<Section> addSection(Elf32_Word, std::shared_ptr<Section>, std::shared_ptr<Section>);
         std::shared_ptr<Segment> addSegment(Elf32_Word);
@@ -103,6 +201,8 @@ struct ElfFile {
         bool readSymbols();
         bool readRelocations();
         bool readProgBits();
+        bool readRelocationTypes();
+        bool readRelaxationRules();
 
         bool readSectionsOfType(Elf32_Word);
 
@@ -111,14 +211,31 @@ struct ElfFile {
         bool generateSectionData();
 
         std::string getFileName() { return fileName; }
+        // for objects built in memory, to name them in diagnostics
+        void setFileName(std::string name) { fileName = name; }
         bool write(std::string);
     private:
         std::string fileName;
 
+        char *mapping;
+        size_t mappingSize;
+        // set when reading from memory someone else owns (an archive member)
+        std::shared_ptr<void> mappingOwner;
+
+        bool mapFile();
+        bool inBounds(Elf32_Off, Elf32_Word);
+
         Elf32_Ehdr header;
 
         std::vector<std::shared_ptr<Section>> sections;
         std::vector<std::shared_ptr<Segment>> segments;
+
+        // lookup indices, rebuilt on demand after sections are added
+        bool indexed;
+        std::unordered_map<std::string, std::vector<std::shared_ptr<Section>>> sectionsByName;
+        std::unordered_map<Elf32_Word, std::vector<std::shared_ptr<Section>>> sectionsByType;
+
+        void indexSections();
 };
 
 }; // namespace libelf